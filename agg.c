@@ -2,134 +2,420 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emulog.h"
+
+#define GB (1024*1024*1024)
+
+// Samples are parsed in chunks by worker threads. Each input has one chunk
+// being merged and one being filled, so memory use depends on the number
+// of inputs but not on the length of the logs.
+#define CHUNK 256
 
 struct sample {
     float localPercent;
     float localGB;
     float remoteGB;
     float totalGB;
-    float time;
+    double time;
+};
+
+struct chunk {
+    struct sample samples[CHUNK];
+    int n;
+};
+
+// A log is either emu text output, or a binary sample log (emu -o) that is
+// mapped and read in place.
+struct input {
+    const char *name;
+    FILE *fp;
+    const struct emulog_header *header;
+    const struct emulog_record *records;
+    size_t nrecords, next;
+    // CLOCK_REALTIME of emu start, from the sync line or the header
+    double start;
+    double time_off;
+
+    // Owned by the merge, and by a worker while fill_pending is set
+    struct chunk chunks[2];
+    int cur, pos;
+    bool fill_pending, eof;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct input **queue;
+    int head, tail, size;
+    bool quit;
+} jobs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
 };
 
-bool parse_sample(const char *buf, struct sample *sample, float time_off)
+bool parse_sample(const char *buf, struct sample *sample)
 {
+    float time;
     int m = sscanf(buf,
             "emu: local%% %f localGB %f remoteGB %f totalGB %f time %f",
             &sample->localPercent, &sample->localGB, &sample->remoteGB,
-            &sample->totalGB, &sample->time);
-    if (m == 5) {
-	    sample->time -= time_off;
-	    return true;
-    } else {
-	    return false;
-    }
+            &sample->totalGB, &time);
+    sample->time = time;
+    return m == 5;
 }
 
-int main(int argc, char **argv)
+static void input_open(struct input *in)
 {
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s log1 log2 ...\n", argv[0]);
-        exit(EXIT_FAILURE);
+    char buf[2048];
+
+    int fd = open(in->name, O_RDONLY);
+    if (fd < 0)
+        goto fail;
+
+    struct stat st;
+    char magic[8] = {};
+    if (fstat(fd, &st) < 0 || pread(fd, magic, sizeof(magic), 0) < 0)
+        goto fail;
+
+    if (st.st_size >= (off_t)sizeof(struct emulog_header) &&
+            memcmp(magic, EMULOG_MAGIC, sizeof(magic)) == 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            goto fail;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        in->header = map;
+        if (in->header->version != EMULOG_VERSION ||
+                in->header->record_size != sizeof(struct emulog_record)) {
+            fprintf(stderr, "error: unsupported sample log version in '%s'\n", in->name);
+            exit(EXIT_FAILURE);
+        }
+        in->records = (const struct emulog_record *)(in->header + 1);
+        // A partially written last record is ignored
+        in->nrecords = (st.st_size - sizeof(*in->header)) / sizeof(*in->records);
+        in->start = in->header->start;
+        return;
+    }
+
+    in->fp = fdopen(fd, "r");
+    if (!in->fp)
+        goto fail;
+
+    // If processes run on different nodes the clocks need to be synced.
+    // emu prints the sync line first, before the target writes anything.
+    while (fgets(buf, sizeof(buf), in->fp)) {
+        if (sscanf(buf, "emu: sync %lf", &in->start) == 1)
+            return;
     }
+    fprintf(stderr, "error: no sync line in '%s'\n", in->name);
+    exit(EXIT_FAILURE);
+
+fail:
+    snprintf(buf, sizeof(buf), "error: opening file '%s'", in->name);
+    perror(buf);
+    exit(EXIT_FAILURE);
+}
 
-    int n = argc - 1;
+// Parse the next chunk of samples, other lines of text logs are skipped.
+static void input_fill(struct input *in, struct chunk *c)
+{
     char buf[2048];
-    FILE **files = malloc(n * sizeof(FILE *));
-    float *time_off = malloc(n * sizeof(float));
-    struct sample *samples = malloc(n * sizeof(struct sample));
-    bool *eof = malloc(n * sizeof(bool));
 
-    for (int i = 0; i < n; i++) {
-        samples[i].time = -INFINITY;
-        eof[i] = false;
+    c->n = 0;
+    if (in->fp) {
+        while (c->n < CHUNK && fgets(buf, sizeof(buf), in->fp)) {
+            if (parse_sample(buf, &c->samples[c->n]))
+                c->samples[c->n++].time += in->time_off;
+        }
+        return;
     }
 
-    for (int i = 0; i < n; i++) {
-        files[i] = fopen(argv[i+1], "r");
-        if (!files[i]) {
-            snprintf(buf, sizeof(buf), "error: opening file '%s'",
-                    argv[i+1]);
-            perror(buf);
-            exit(EXIT_FAILURE);
+    const float page_gb = in->header->page_size / (float)GB;
+    while (c->n < CHUNK && in->next < in->nrecords) {
+        const struct emulog_record *r = &in->records[in->next++];
+        if (!(r->flags & EMULOG_NODES))
+            continue;
+
+        struct sample *s = &c->samples[c->n++];
+        s->localGB = r->node_pages[0] * page_gb;
+        s->remoteGB = r->node_pages[1] * page_gb;
+        s->totalGB = s->localGB + s->remoteGB;
+        s->localPercent = 100.0f * s->localGB / s->totalGB;
+        s->time = r->time + in->time_off;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&jobs.lock);
+    for (;;) {
+        while (jobs.head == jobs.tail && !jobs.quit)
+            pthread_cond_wait(&jobs.work, &jobs.lock);
+        if (jobs.head == jobs.tail)
+            break;
+
+        struct input *in = jobs.queue[jobs.head];
+        jobs.head = (jobs.head + 1) % jobs.size;
+        pthread_mutex_unlock(&jobs.lock);
+
+        if (!in->fp && !in->header)
+            input_open(in);
+        else
+            input_fill(in, &in->chunks[!in->cur]);
+
+        pthread_mutex_lock(&jobs.lock);
+        in->fill_pending = false;
+        pthread_cond_broadcast(&jobs.done);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return NULL;
+}
+
+// Each input is queued at most once at a time.
+static void submit(struct input *in)
+{
+    pthread_mutex_lock(&jobs.lock);
+    in->fill_pending = true;
+    jobs.queue[jobs.tail] = in;
+    jobs.tail = (jobs.tail + 1) % jobs.size;
+    pthread_cond_signal(&jobs.work);
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+static void wait_filled(struct input *in)
+{
+    pthread_mutex_lock(&jobs.lock);
+    while (in->fill_pending)
+        pthread_cond_wait(&jobs.done, &jobs.lock);
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+// Current sample of an input, NULL at the end. Switching to the next chunk
+// queues a refill of the one just used.
+static struct sample *input_peek(struct input *in)
+{
+    if (in->pos == in->chunks[in->cur].n) {
+        if (in->eof)
+            return NULL;
+
+        wait_filled(in);
+        in->cur = !in->cur;
+        in->pos = 0;
+        if (in->chunks[in->cur].n == 0) {
+            in->eof = true;
+            return NULL;
         }
-        if (!fgets(buf, sizeof(buf), files[i])) {
-            snprintf(buf, sizeof(buf), "error: reading file '%s'",
-                    argv[i+1]);
-            perror(buf);
+        submit(in);
+    }
+    return &in->chunks[in->cur].samples[in->pos];
+}
+
+// Min-heap of inputs ordered by the time of their current sample
+static void heap_down(struct input **heap, int n, int i)
+{
+    for (;;) {
+        int l = 2*i + 1, r = l + 1, m = i;
+        if (l < n && input_peek(heap[l])->time < input_peek(heap[m])->time)
+            m = l;
+        if (r < n && input_peek(heap[r])->time < input_peek(heap[m])->time)
+            m = r;
+        if (m == i)
+            return;
+        struct input *t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+static float percentile(const float *sorted, int n, float p)
+{
+    return sorted[(int)(p * (n - 1) + 0.5f)];
+}
+
+// Print the statistics of an interval where every input has a sample
+static void print_interval(const struct sample *samples, int n, float *local)
+{
+    struct sample agg = {}, max = {};
+    for (int j = 0; j < n; j++) {
+        agg.localPercent += samples[j].localPercent;
+        agg.localGB += samples[j].localGB;
+        agg.remoteGB += samples[j].remoteGB;
+        agg.totalGB += samples[j].totalGB;
+        agg.time += samples[j].time;
+        max.localGB = fmaxf(max.localGB, samples[j].localGB);
+        max.remoteGB = fmaxf(max.remoteGB, samples[j].remoteGB);
+        max.totalGB = fmaxf(max.totalGB, samples[j].totalGB);
+        local[j] = samples[j].localPercent;
+    }
+    agg.localPercent /= n;
+    agg.time /= n;
+    float var = 0;
+    for (int j = 0; j < n; j++) {
+        float d = agg.localPercent-samples[j].localPercent;
+        var += d*d;
+    }
+    float stddev = n > 1 ? sqrtf(var / (n-1)) : 0;
+
+    qsort(local, n, sizeof(float), cmp_float);
+
+    printf("emu: local%% %3.2f %.2f localGB %.2f remoteGB %.2f totalGB %.2f time %.2f"
+            " min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f maxlocalGB %.2f maxremoteGB %.2f maxtotalGB %.2f\n",
+            agg.localPercent, stddev, agg.localGB, agg.remoteGB, agg.totalGB, agg.time,
+            local[0], percentile(local, n, 0.5f), percentile(local, n, 0.9f),
+            percentile(local, n, 0.99f), local[n-1],
+            max.localGB, max.remoteGB, max.totalGB);
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-i interval] [-w tolerance] [-j threads] log1 log2 ...\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    double interval = 1;
+    double tolerance = -1;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:w:j:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'w':
+            tolerance = atof(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
             exit(EXIT_FAILURE);
         }
-        // If processes run on different nodes the clocks need to be synced
-        if (sscanf(buf, "emu: sync %f", time_off+i) != 1) {
-            snprintf(buf, sizeof(buf), "error: reading sync line of '%s'",
-                    argv[i+1]);
-            perror(buf);
+    }
+    if (tolerance < 0)
+        tolerance = interval / 2;
+
+    if (argc - optind < 1 || interval <= 0 || nthreads < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int n = argc - optind;
+    struct input *inputs = calloc(n, sizeof(struct input));
+    struct input **heap = malloc(n * sizeof(struct input *));
+    struct sample *samples = malloc(n * sizeof(struct sample));
+    long *bucket_of = malloc(n * sizeof(long));
+    float *local = malloc(n * sizeof(float));
+    jobs.size = n + 1;
+    jobs.queue = malloc(jobs.size * sizeof(struct input *));
+    if (!inputs || !heap || !samples || !bucket_of || !local || !jobs.queue) {
+        perror("error: allocating inputs");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nthreads > n)
+        nthreads = n;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, NULL)) {
+            perror("error: starting worker");
             exit(EXIT_FAILURE);
         }
     }
 
+    // Open all inputs in parallel to get their start times
+    for (int i = 0; i < n; i++) {
+        inputs[i].name = argv[optind + i];
+        submit(&inputs[i]);
+    }
+
+    double start = INFINITY;
+    for (int i = 0; i < n; i++) {
+        wait_filled(&inputs[i]);
+        if (inputs[i].start < start)
+            start = inputs[i].start;
+    }
+
+    // Align all logs to the one that started first, and start parsing
+    for (int i = 0; i < n; i++) {
+        inputs[i].time_off = inputs[i].start - start;
+        inputs[i].cur = 1;
+        submit(&inputs[i]);
+        bucket_of[i] = LONG_MIN;
+    }
+
     printf("agg: %d files\n", n);
 
-    float center = 0;
+    int nheap = 0;
+    for (int i = 0; i < n; i++) {
+        if (input_peek(&inputs[i]))
+            heap[nheap++] = &inputs[i];
+    }
+    for (int i = nheap / 2 - 1; i >= 0; i--)
+        heap_down(heap, nheap, i);
+
+    // Samples may be missing from some processes due to mlock at the start
+    // or due to finishing earlier. Samples are merged in time order into
+    // intervals centered on multiples of the interval, and an interval is
+    // printed if every process has a sample within the tolerance.
+    long bucket = LONG_MIN;
     int collected = 0;
-    int neof = 0;
-
-    // Samples may be missing from some processes main due to mlock at the
-    // start or due to finishing earlier.
-    // Find 1-second intervals where every process has been sampled:
-    while (neof < n) {
-        for (int i = 0; i < n; i++) {
-            if (eof[i])
-                continue;
-
-            for (;;) {
-                float delta = center - samples[i].time;
-                if (delta > 0.5) {
-                    // We are behind, get next sample
-                    if (!fgets(buf, sizeof(buf), files[i])) {
-                        eof[i] = true;
-                        neof++;
-                        break;
-                    }
-
-                    if (!parse_sample(buf, samples+i, time_off[i]))
-                        printf("%s", buf);
-
-                    continue;
-                } else if (delta < -0.5) {
-                    // We are ahead, move interval forward
-                    center = samples[i].time;
-                    collected = 0;
-                }
 
-                collected++;
-                break;
-            }
+    while (nheap > 0) {
+        struct input *in = heap[0];
+        struct sample *s = input_peek(in);
+        int rank = in - inputs;
 
-            if (collected == n) {
+        long k = lround(s->time / interval);
+        if (fabs(s->time - k * interval) <= tolerance) {
+            if (k != bucket) {
+                if (collected == n)
+                    print_interval(samples, n, local);
+                bucket = k;
                 collected = 0;
-                center += 1;
-
-                struct sample agg = {};
-                for (int j = 0; j < n; j++) {
-                    agg.localPercent += samples[j].localPercent;
-                    agg.localGB += samples[j].localGB;
-                    agg.remoteGB += samples[j].remoteGB;
-                    agg.totalGB += samples[j].totalGB;
-                    agg.time += samples[j].time;
-                }
-                agg.localPercent /= n;
-                agg.time /= n;
-                float var = 0;
-                for (int j = 0; j < n; j++) {
-                    float d = agg.localPercent-samples[j].localPercent;
-                    var += d*d;
-                }
-                float stddev = sqrtf(var / (n-1));
-                printf("emu: local%% %3.2f %.2f localGB %.2f remoteGB %.2f totalGB %.2f time %.2f\n",
-                        agg.localPercent, stddev, agg.localGB, agg.remoteGB, agg.totalGB, agg.time);
             }
+            if (bucket_of[rank] != k) {
+                bucket_of[rank] = k;
+                collected++;
+            }
+            samples[rank] = *s;
         }
+
+        in->pos++;
+        if (!input_peek(in))
+            heap[0] = heap[--nheap];
+        heap_down(heap, nheap, 0);
     }
+    if (collected == n)
+        print_interval(samples, n, local);
+
+    pthread_mutex_lock(&jobs.lock);
+    jobs.quit = true;
+    pthread_cond_broadcast(&jobs.work);
+    pthread_mutex_unlock(&jobs.lock);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
 }
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,8 +15,30 @@
 #include <sys/signalfd.h>
 #include <fcntl.h>
 #include <stdbool.h>
-#include <fnmatch.h>
+#include <regex.h>
 #include <pty.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <numaif.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "emulog.h"
+#include "emuphase.h"
+#include "emualloc.h"
+#include "emutrace.h"
 
 #define KB 1024
 #define MB (1024*1024)
@@ -27,138 +50,5366 @@
 
 static char tmp[4096];
 
-float get_time()
+// Decimals of the time column, more with sub-second intervals
+static int time_digits = 2;
+
+double get_time()
+{
+    static struct timespec start = {};
+
+    if (start.tv_sec == 0 && start.tv_nsec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        return 0.0;
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+	    return (now.tv_sec-start.tv_sec) + 1e-9*(now.tv_nsec-start.tv_nsec);
+    }
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec-a->tv_sec) + 1e-9*(b->tv_nsec-a->tv_nsec);
+}
+
+// Time spent by emu itself in each expensive step, summarized at exit.
+// Percentiles come from a histogram with 4 buckets per power of two of
+// nanoseconds, so they are within about 20% and memory does not grow with
+// the length of the run.
+enum overhead_step {
+    OVERHEAD_NUMA_MAPS,
+    OVERHEAD_CGROUP,
+    OVERHEAD_SMAPS_ROLLUP,
+    OVERHEAD_SMAPS,
+    OVERHEAD_CLEAR_REFS,
+    OVERHEAD_IDLE,
+    OVERHEAD_DIRTY,
+    OVERHEAD_TIER,
+    OVERHEAD_RELAY,
+    OVERHEAD_RESERVE,
+    OVERHEAD_ALLOC,
+    OVERHEAD_METRICS,
+    OVERHEAD_TRACE,
+    OVERHEAD_STEPS,
+};
+
+static const char *overhead_names[] = {
+    "numa_maps", "cgroup", "smaps_rollup", "smaps", "clear_refs",
+    "idle", "dirty", "tier", "relay", "reserve", "allocsites", "metrics",
+    "trace",
+};
+
+#define OVERHEAD_BUCKETS (64*4)
+
+static struct {
+    long count[OVERHEAD_STEPS];
+    double total[OVERHEAD_STEPS];
+    double max[OVERHEAD_STEPS];
+    uint32_t hist[OVERHEAD_STEPS][OVERHEAD_BUCKETS];
+    // Time since the last summary line, for the -O column
+    double since_sample;
+    bool column;
+} overhead;
+
+static void overhead_add(enum overhead_step step, double sec)
+{
+    uint64_t ns = sec * 1e9 + 1;
+    int log2 = 63 - __builtin_clzll(ns);
+    int frac = log2 >= 2 ? (ns >> (log2 - 2)) & 3 : 0;
+
+    overhead.count[step]++;
+    overhead.total[step] += sec;
+    if (sec > overhead.max[step])
+        overhead.max[step] = sec;
+    overhead.hist[step][4*log2 + frac]++;
+    overhead.since_sample += sec;
+}
+
+// Upper end of the bucket holding the p quantile
+static double overhead_percentile(enum overhead_step step, double p)
+{
+    long rank = p * overhead.count[step];
+    long seen = 0;
+
+    for (int b = 0; b < OVERHEAD_BUCKETS; b++) {
+        seen += overhead.hist[step][b];
+        if (seen > rank) {
+            int log2 = b / 4, frac = b % 4;
+            double ns = log2 >= 2 ? (double)((uint64_t)(5 + frac) << (log2 - 2)) : (double)(2 << log2);
+            double sec = 1e-9 * ns;
+            return sec < overhead.max[step] ? sec : overhead.max[step];
+        }
+    }
+    return overhead.max[step];
+}
+
+// Column with the time spent since the previous summary line, with -O
+static const char *overhead_column(void)
+{
+    static char buf[32];
+
+    buf[0] = '\0';
+    if (overhead.column)
+        snprintf(buf, sizeof(buf), " overheadms %.3f", 1e3 * overhead.since_sample);
+    overhead.since_sample = 0;
+    return buf;
+}
+
+void overhead_summary(void)
+{
+    for (int i = 0; i < OVERHEAD_STEPS; i++) {
+        if (!overhead.count[i])
+            continue;
+        printf("emu: overhead %s count %ld totalms %.3f p50ms %.3f p99ms %.3f maxms %.3f\n",
+                overhead_names[i], overhead.count[i], 1e3 * overhead.total[i],
+                1e3 * overhead_percentile(i, 0.5), 1e3 * overhead_percentile(i, 0.99),
+                1e3 * overhead.max[i]);
+    }
+
+    struct rusage ru;
+    PERR(getrusage(RUSAGE_SELF, &ru) < 0, "emu: getrusage");
+    printf("emu: overhead usercpus %.3f syscpus %.3f maxrssKB %ld time %.*f\n",
+            ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec,
+            ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec,
+            ru.ru_maxrss, time_digits, get_time());
+}
+
+// Performance counters of the target (-p), opened on the child before it
+// execs and inherited by its threads and processes. All counters form one
+// group, so they are read together with one read() on the timer tick and
+// cover the same time. Events the kernel or hardware does not support are
+// left out, which without a PMU leaves the software events.
+#define PERF_MAX 8
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_MAX] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cachemisses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"nodeloads", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+    {"nodestores", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE |
+        (PERF_COUNT_HW_CACHE_OP_WRITE << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+    {"pagefaults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"ctxswitches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+};
+
+static struct {
+    int leader;
+    int fds[PERF_MAX];
+    uint64_t ids[PERF_MAX];
+    // Scaled totals at the previous read
+    double prev[PERF_MAX];
+    bool open[PERF_MAX];
+} perf = {.leader = -1};
+
+static int perf_event_open(struct perf_event_attr *attr, int pid, int group)
+{
+    return syscall(SYS_perf_event_open, attr, pid, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Open the counters on pid, which must not have exec'd yet. They start
+// counting at its exec.
+void perf_open(int pid)
+{
+    for (int i = 0; i < PERF_MAX; i++) {
+        struct perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if (perf.leader < 0) {
+            attr.disabled = 1;
+            attr.enable_on_exec = 1;
+        }
+
+        int fd = perf_event_open(&attr, pid, perf.leader);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            // perf_event_paranoid may only allow user space counting
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = perf_event_open(&attr, pid, perf.leader);
+        }
+        if (fd < 0)
+            continue;
+
+        PERR(ioctl(fd, PERF_EVENT_IOC_ID, &perf.ids[i]) < 0, "emu: perf event id");
+        perf.fds[i] = fd;
+        perf.open[i] = true;
+        if (perf.leader < 0)
+            perf.leader = fd;
+    }
+
+    if (perf.leader < 0)
+        fprintf(stderr, "emu: warning: no performance counters available\n");
+}
+
+// Counter deltas since the previous call, as columns of a summary line
+static const char *perf_column(void)
+{
+    static char buf[512];
+    uint64_t data[3 + 2*PERF_MAX];
+
+    buf[0] = '\0';
+    if (perf.leader < 0)
+        return buf;
+
+    ssize_t n = read(perf.leader, data, sizeof(data));
+    if (n < (ssize_t)(3 * sizeof(uint64_t)))
+        return buf;
+
+    // Scale for multiplexing with other users of the PMU
+    uint64_t enabled = data[1], running = data[2];
+    double scale = running && running < enabled ? (double)enabled / running : 1;
+
+    size_t len = 0;
+    double delta[PERF_MAX] = {};
+    for (uint64_t j = 0; j < data[0] && j < PERF_MAX; j++) {
+        for (int i = 0; i < PERF_MAX; i++) {
+            if (perf.open[i] && perf.ids[i] == data[4 + 2*j]) {
+                double v = data[3 + 2*j] * scale;
+                delta[i] = v - perf.prev[i];
+                perf.prev[i] = v;
+            }
+        }
+    }
+
+    for (int i = 0; i < PERF_MAX; i++) {
+        if (perf.open[i])
+            len += snprintf(buf + len, sizeof(buf) - len, " %s %.0f", perf_events[i].name, delta[i]);
+    }
+    if (perf.open[0] && perf.open[1] && delta[0] > 0)
+        snprintf(buf + len, sizeof(buf) - len, " ipc %.3f", delta[1] / delta[0]);
+    return buf;
+}
+
+void perf_close(void)
+{
+    for (int i = 0; i < PERF_MAX; i++) {
+        if (perf.open[i])
+            close(perf.fds[i]);
+        perf.open[i] = false;
+    }
+    perf.leader = -1;
+}
+
+// A /proc/<pid> file kept open between samples. The buffer is reused, so a
+// sample costs one read of the text and no allocations once the buffer has
+// grown to fit the address space.
+struct procfile {
+    int pid;
+    const char *name;
+    int fd;
+    char *buf;
+    size_t size;
+    size_t len;
+    // Process may exit at any time, failures are not fatal
+    bool optional;
+};
+
+void procfile_init(struct procfile *pf, int pid, const char *name)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->pid = pid;
+    pf->name = name;
+    pf->fd = -1;
+}
+
+static bool procfile_open(struct procfile *pf)
+{
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/proc/%d/%s", pf->pid, pf->name);
+
+    if (pf->fd >= 0)
+        close(pf->fd);
+
+    pf->fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (pf->fd < 0) {
+        if (pf->optional)
+            return false;
+        sprintf(tmp, "emu: can't read %s", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+void procfile_close(struct procfile *pf)
+{
+    if (pf->fd >= 0)
+        close(pf->fd);
+    free(pf->buf);
+    pf->fd = -1;
+    pf->buf = NULL;
+    pf->size = 0;
+}
+
+// Read a whole /proc or /sys file from the start into *buf, growing it as
+// needed. The result is NUL-terminated; returns its length.
+static size_t pread_all(int fd, char **buf, size_t *size, const char *what)
+{
+    size_t len = 0;
+
+    for (;;) {
+        if (*size - len < 2) {
+            size_t newsize = *size ? 2 * *size : 64*KB;
+            *buf = realloc(*buf, newsize);
+            PERR(!*buf, "emu: read buffer");
+            *size = newsize;
+        }
+
+        ssize_t n = pread(fd, *buf + len, *size - len - 1, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            sprintf(tmp, "emu: can't read %s", what);
+            perror(tmp);
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    (*buf)[len] = '\0';
+
+    return len;
+}
+
+// The fd refers to the address space that existed when it was opened, so an
+// empty read means the target has exec'd since and the file must be reopened.
+static bool procfile_read(struct procfile *pf)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((pf->fd < 0 || attempt > 0) && !procfile_open(pf))
+            return false;
+
+        pf->len = pread_all(pf->fd, &pf->buf, &pf->size, pf->name);
+        if (pf->len > 0)
+            break;
+    }
+    return true;
+}
+
+// Output markers: the -S and -E patterns and the named phase patterns of
+// -M. The fnmatch patterns of each kind are translated to one extended
+// regex, with a group per pattern for phases, so a line of target output is
+// scanned at most once per kind however many patterns there are, and can
+// both start or end monitoring and begin a phase. Most lines match none, so
+// they are first checked for the longest literal part of each pattern,
+// which is much faster. A phase lasts from a match of its pattern, or a
+// begin marker of libemuphase, to the next phase or the end, and samples
+// taken meanwhile are accounted to it. Phases with the same name are
+// aggregated across iterations.
+#define MARKERS_MAX 64
+
+enum marker_kind {MARKER_START, MARKER_END, MARKER_PHASE, MARKER_KINDS};
+
+struct phase_stats {
+    const char *name;
+    int count;
+    double time;
+    // Accumulated over the emulation and profiling samples of the phase
+    int nodes_samples, memprof_samples;
+    double local, hot;
+    double nodes_kb, memprof_kb;
+    double nodes_peak_kb, memprof_peak_kb;
+};
+
+struct markers {
+    int n;
+    struct {
+        enum marker_kind kind;
+        const char *pattern;
+        int phase;
+        char *literal;
+        size_t literal_len;
+    } marker[MARKERS_MAX];
+    // One regex per kind, only the phase one has groups
+    regex_t re[MARKER_KINDS];
+    bool used[MARKER_KINDS];
+    regmatch_t *match;
+    // Phase of the last line that matched a phase pattern
+    int matched_phase;
+    int nphases;
+    struct phase_stats phase[MARKERS_MAX];
+    // Current phase and when it started
+    int current;
+    double start;
+};
+
+static struct markers markers = {.current = -1};
+
+// Index of the phase called name, added if new, or -1 if there are too many
+int markers_phase_find(const char *name)
+{
+    for (int i = 0; i < markers.nphases; i++)
+        if (strcmp(markers.phase[i].name, name) == 0)
+            return i;
+
+    if (markers.nphases == MARKERS_MAX)
+        return -1;
+    markers.phase[markers.nphases].name = strdup(name);
+    PERR(!markers.phase[markers.nphases].name, "emu: allocate phase name");
+    return markers.nphases++;
+}
+
+void markers_add(enum marker_kind kind, const char *pattern, const char *name)
+{
+    if (markers.n == MARKERS_MAX) {
+        fprintf(stderr, "error: more than %d output patterns\n", MARKERS_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    markers.marker[markers.n].kind = kind;
+    markers.marker[markers.n].pattern = pattern;
+    markers.marker[markers.n].phase = kind == MARKER_PHASE ? markers_phase_find(name) : -1;
+    markers.n++;
+}
+
+// Closing bracket of a bracket expression starting after '[', if any
+static const char *glob_bracket_end(const char *p)
+{
+    if (*p == '!' || *p == '^')
+        p++;
+    if (*p == ']')
+        p++;
+    while (*p && *p != ']')
+        p++;
+    return *p ? p : NULL;
+}
+
+// Longest part of an fnmatch pattern without wildcards, which every match
+// contains
+static char *glob_literal(const char *g)
+{
+    char *lit = malloc(strlen(g) + 1);
+    PERR(!lit, "emu: allocate output pattern");
+
+    size_t best = 0, best_len = 0, len = 0;
+    char *run = lit;
+    for (;;) {
+        char c = *g++;
+        const char *end = NULL;
+
+        if (c == '\0' || c == '*' || c == '?' ||
+                (c == '[' && (end = glob_bracket_end(g)))) {
+            if (len > best_len) {
+                best = run - lit - len;
+                best_len = len;
+            }
+            if (c == '\0')
+                break;
+            if (end)
+                g = end + 1;
+            len = 0;
+            continue;
+        }
+
+        if (c == '\\' && *g)
+            c = *g++;
+        *run++ = c;
+        len++;
+    }
+
+    memmove(lit, lit + best, best_len);
+    lit[best_len] = '\0';
+    return lit;
+}
+
+// Translate an fnmatch pattern to an extended regex, writing at most
+// twice its length
+static char *glob_to_regex(const char *g, char *r)
+{
+    while (*g) {
+        char c = *g++;
+        const char *end;
+
+        if (c == '*') {
+            *r++ = '.';
+            *r++ = '*';
+        } else if (c == '?') {
+            *r++ = '.';
+        } else if (c == '[' && (end = glob_bracket_end(g))) {
+            *r++ = '[';
+            if (*g == '!') {
+                *r++ = '^';
+                g++;
+            }
+            while (g <= end)
+                *r++ = *g++;
+        } else {
+            if (c == '\\' && *g)
+                c = *g++;
+            if (strchr(".[]()*+?{}|^$\\", c))
+                *r++ = '\\';
+            *r++ = c;
+        }
+    }
+    return r;
+}
+
+void markers_compile(void)
+{
+    size_t size = 1;
+    for (int i = 0; i < markers.n; i++) {
+        size += 2 * strlen(markers.marker[i].pattern) + 5;
+        markers.marker[i].literal = glob_literal(markers.marker[i].pattern);
+        markers.marker[i].literal_len = strlen(markers.marker[i].literal);
+    }
+
+    char *re = malloc(size);
+    PERR(!re, "emu: allocate output patterns");
+
+    for (int k = 0; k < MARKER_KINDS; k++) {
+        char *r = re;
+        for (int i = 0; i < markers.n; i++) {
+            if (markers.marker[i].kind != (enum marker_kind)k)
+                continue;
+            if (r != re)
+                *r++ = '|';
+            r = stpcpy(r, "^(");
+            r = glob_to_regex(markers.marker[i].pattern, r);
+            r = stpcpy(r, ")$");
+        }
+        *r = '\0';
+        if (r == re)
+            continue;
+
+        int err = regcomp(&markers.re[k], re, REG_EXTENDED | (k == MARKER_PHASE ? 0 : REG_NOSUB));
+        if (err) {
+            regerror(err, &markers.re[k], tmp, sizeof(tmp));
+            fprintf(stderr, "error: invalid output pattern: %s\n", tmp);
+            exit(EXIT_FAILURE);
+        }
+        markers.used[k] = true;
+    }
+    free(re);
+
+    markers.match = calloc(markers.n + 1, sizeof(*markers.match));
+    PERR(!markers.match, "emu: allocate output pattern matches");
+}
+
+// Whether a pattern of kind may match, from the literal parts
+static bool markers_candidate(enum marker_kind kind, const char *line, size_t len)
+{
+    for (int i = 0; i < markers.n; i++) {
+        if (markers.marker[i].kind != kind)
+            continue;
+        if (!markers.marker[i].literal_len ||
+                memmem(line, len, markers.marker[i].literal, markers.marker[i].literal_len))
+            return true;
+    }
+    return false;
+}
+
+// Kinds of the patterns matching line of len bytes, as a mask of 1 << kind,
+// or 0. For a phase, markers.matched_phase is the phase of the first phase
+// pattern that matches.
+int markers_match(const char *line, size_t len)
+{
+    int kinds = 0;
+
+    for (int k = 0; k < MARKER_KINDS; k++) {
+        if (!markers.used[k] || !markers_candidate(k, line, len))
+            continue;
+
+        if (k != MARKER_PHASE) {
+            if (regexec(&markers.re[k], line, 0, NULL, 0) == 0)
+                kinds |= 1 << k;
+            continue;
+        }
+
+        if (regexec(&markers.re[k], line, markers.n + 1, markers.match, 0) != 0)
+            continue;
+        // Groups are numbered in the order of the phase patterns
+        int group = 1;
+        for (int i = 0; i < markers.n; i++) {
+            if (markers.marker[i].kind != MARKER_PHASE)
+                continue;
+            if (markers.match[group++].rm_so >= 0) {
+                markers.matched_phase = markers.marker[i].phase;
+                kinds |= 1 << k;
+                break;
+            }
+        }
+    }
+    return kinds;
+}
+
+// End the current phase, if any, and start phase, -1 for none
+void markers_phase(int phase, double now)
+{
+    if (markers.current >= 0) {
+        struct phase_stats *p = &markers.phase[markers.current];
+        p->count++;
+        p->time += now - markers.start;
+    }
+    markers.current = phase;
+    markers.start = now;
+}
+
+static void markers_account(const struct emulog_record *rec, long page_size)
+{
+    if (markers.current < 0)
+        return;
+
+    struct phase_stats *p = &markers.phase[markers.current];
+    if (rec->flags & EMULOG_NODES) {
+        uint64_t pages = rec->node_pages[0] + rec->node_pages[1];
+        double kb = (double)pages * page_size / KB;
+
+        p->nodes_samples++;
+        p->local += pages ? (double)rec->node_pages[0] / pages : 0;
+        p->nodes_kb += kb;
+        if (kb > p->nodes_peak_kb)
+            p->nodes_peak_kb = kb;
+    } else {
+        p->memprof_samples++;
+        p->hot += rec->rss_kb ? (double)rec->ref_kb / rec->rss_kb : 0;
+        p->memprof_kb += rec->rss_kb;
+        if (rec->rss_kb > p->memprof_peak_kb)
+            p->memprof_peak_kb = rec->rss_kb;
+    }
+}
+
+// One line per phase name. Memory comes from the emulation samples if
+// there are any, they see both nodes, and from profiling otherwise.
+void markers_summary(void)
+{
+    markers_phase(-1, get_time());
+
+    for (int i = 0; i < markers.nphases; i++) {
+        struct phase_stats *p = &markers.phase[i];
+        if (!p->count)
+            continue;
+
+        int len = snprintf(tmp, sizeof(tmp), "emu: phase %s count %d timesec %.*f meansec %.*f",
+                p->name, p->count, time_digits, p->time, time_digits, p->time / p->count);
+
+        int samples = p->nodes_samples ? p->nodes_samples : p->memprof_samples;
+        double kb = p->nodes_samples ? p->nodes_kb : p->memprof_kb;
+        double peak_kb = p->nodes_samples ? p->nodes_peak_kb : p->memprof_peak_kb;
+        len += snprintf(tmp + len, sizeof(tmp) - len, " samples %d", samples);
+        if (samples)
+            len += snprintf(tmp + len, sizeof(tmp) - len, " peakrssGB %.2f meanrssGB %.2f",
+                    peak_kb * KB / GB, kb / samples * KB / GB);
+        if (p->nodes_samples)
+            len += snprintf(tmp + len, sizeof(tmp) - len, " local%% %.2f",
+                    100 * p->local / p->nodes_samples);
+        if (p->memprof_samples)
+            len += snprintf(tmp + len, sizeof(tmp) - len, " hot %.4f",
+                    p->hot / p->memprof_samples);
+        printf("%s\n", tmp);
+    }
+}
+
+// Binary sample log (-o). Summary samples are also appended to it as
+// records, one write per record, so the log stays valid if emu is killed.
+// The last record of each kind is kept for the adaptive interval and the
+// metrics socket.
+struct sample_log {
+    int fd;
+    int rank;
+    uint32_t phase;
+    long page_size;
+    // Summary records so far, logged or not
+    uint64_t count;
+    struct emulog_record last_nodes, last_memprof;
+};
+
+static struct sample_log sample_log = {.fd = -1};
+
+void sample_log_init(int rank)
+{
+    sample_log.rank = rank;
+    sample_log.page_size = numa_pagesize();
+}
+
+void sample_log_open(const char *fname)
+{
+    sample_log.fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (sample_log.fd < 0) {
+        sprintf(tmp, "emu: can't open sample log '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct emulog_header h = {};
+    memcpy(h.magic, EMULOG_MAGIC, sizeof(h.magic));
+    h.version = EMULOG_VERSION;
+    h.record_size = sizeof(struct emulog_record);
+    h.rank = sample_log.rank;
+    h.page_size = sample_log.page_size;
+    h.start = now.tv_sec + 1e-9*now.tv_nsec - get_time();
+    PERR(write(sample_log.fd, &h, sizeof(h)) != sizeof(h), "emu: write sample log");
+}
+
+static void sample_log_write(struct emulog_record *rec)
+{
+    rec->time = get_time();
+    rec->rank = sample_log.rank;
+    rec->phase = sample_log.phase;
+    sample_log.count++;
+
+    if (rec->flags & EMULOG_NODES)
+        sample_log.last_nodes = *rec;
+    else
+        sample_log.last_memprof = *rec;
+    markers_account(rec, sample_log.page_size);
+
+    if (sample_log.fd < 0)
+        return;
+    PERR(write(sample_log.fd, rec, sizeof(*rec)) != sizeof(*rec), "emu: write sample log");
+}
+
+void sample_log_close(void)
+{
+    if (sample_log.fd >= 0)
+        close(sample_log.fd);
+    sample_log.fd = -1;
+}
+
+// Local and far node sets (-L, -F), nodes 0 and 1 by default. Pages on the
+// local nodes count as local and pages on the far nodes as remote; pages on
+// nodes in neither set are left out with a warning. The reservation is made
+// on every local node, the target runs on the CPUs of the local nodes, and
+// -l 0, -i and -X use only nodes of the two sets, so instances with disjoint
+// sets (one per socket, say) can run side by side. With either option given,
+// sample lines also get a nodeNGB column for each node of the sets.
+#define NODES_MAX 64
+
+struct topology {
+    struct bitmask *local, *far, *both;
+    // 0 for local nodes, 1 for far nodes, -1 for the others
+    int side[NODES_MAX];
+    // Nodes of both sets, local first
+    int nodes[NODES_MAX];
+    int n, nlocal;
+    bool columns;
+    bool warned[NODES_MAX];
+};
+
+static struct topology topology;
+
+// Parse a node list like "0-1,4", or set only node without one
+static struct bitmask *topology_set(const char *s, int node)
+{
+    struct bitmask *set = numa_bitmask_alloc(NODES_MAX);
+    PERR(!set, "emu: node set");
+    if (!s) {
+        numa_bitmask_setbit(set, node);
+        return set;
+    }
+
+    struct bitmask *parsed = numa_parse_nodestring(s);
+    if (!parsed)
+        return NULL;
+    for (unsigned int i = 0; i < parsed->size; i++) {
+        if (!numa_bitmask_isbitset(parsed, i))
+            continue;
+        if (i >= NODES_MAX) {
+            numa_bitmask_free(parsed);
+            return NULL;
+        }
+        numa_bitmask_setbit(set, i);
+    }
+    numa_bitmask_free(parsed);
+
+    return numa_bitmask_weight(set) ? set : NULL;
+}
+
+// Returns false for invalid or overlapping sets
+bool topology_init(const char *local, const char *far)
+{
+    struct topology *t = &topology;
+
+    t->local = topology_set(local, 0);
+    t->far = topology_set(far, 1);
+    if (!t->local || !t->far)
+        return false;
+
+    t->both = numa_bitmask_alloc(NODES_MAX);
+    PERR(!t->both, "emu: node set");
+    for (int node = 0; node < NODES_MAX; node++) {
+        t->side[node] = -1;
+        if (numa_bitmask_isbitset(t->local, node)) {
+            t->side[node] = 0;
+            t->nodes[t->n++] = node;
+            t->nlocal++;
+            numa_bitmask_setbit(t->both, node);
+        }
+    }
+    for (int node = 0; node < NODES_MAX; node++) {
+        if (!numa_bitmask_isbitset(t->far, node))
+            continue;
+        if (t->side[node] == 0)
+            return false;
+        t->side[node] = 1;
+        t->nodes[t->n++] = node;
+        numa_bitmask_setbit(t->both, node);
+    }
+
+    t->columns = local || far;
+    if (t->columns) {
+        int len = snprintf(tmp, sizeof(tmp), "emu: nodes local");
+        for (int i = 0; i < t->n; i++)
+            len += snprintf(tmp + len, sizeof(tmp) - len, "%s%d",
+                    i == t->nlocal ? " far " : i ? "," : " ", t->nodes[i]);
+        printf("%s\n", tmp);
+    }
+    return true;
+}
+
+// 0 if node is local, 1 if far, -1 otherwise
+static inline int topology_side(int node)
+{
+    return node >= 0 && node < NODES_MAX ? topology.side[node] : -1;
+}
+
+// Side of a node the target has pages on, warning once about the others
+static int topology_account(int node)
+{
+    int side = topology_side(node);
+    if (side < 0 && !topology.warned[node % NODES_MAX]) {
+        topology.warned[node % NODES_MAX] = true;
+        fprintf(stderr, "emu: warning: skipping data for node %d\n", node);
+    }
+    return side;
+}
+
+// Free bytes on the nodes of a side, and the node with the most
+static long long topology_free(int side, int *roomiest)
+{
+    long long sum = 0, most = -1;
+    for (int i = 0; i < topology.n; i++) {
+        int node = topology.nodes[i];
+        long long avail = 0;
+        if (topology.side[node] != side || numa_node_size64(node, &avail) < 0)
+            continue;
+        sum += avail;
+        if (avail > most) {
+            most = avail;
+            if (roomiest)
+                *roomiest = node;
+        }
+    }
+    return sum;
+}
+
+// CPUs of the local nodes
+static struct bitmask *topology_cpus(void)
+{
+    struct bitmask *cpus = numa_allocate_cpumask();
+    struct bitmask *node_cpus = numa_allocate_cpumask();
+
+    for (int i = 0; i < topology.nlocal; i++) {
+        PERR(numa_node_to_cpus(topology.nodes[i], node_cpus) < 0, "emu: cpus of local node");
+        for (unsigned int cpu = 0; cpu < cpus->size; cpu++) {
+            if (numa_bitmask_isbitset(node_cpus, cpu))
+                numa_bitmask_setbit(cpus, cpu);
+        }
+    }
+    numa_free_cpumask(node_cpus);
+    return cpus;
+}
+
+// Per-node columns, empty without -L or -F
+static const char *topology_columns(const long long *by_node)
+{
+    static char buf[NODES_MAX * 24];
+    int len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; topology.columns && i < topology.n; i++)
+        len += snprintf(buf + len, sizeof(buf) - len, " node%dGB %.2f",
+                topology.nodes[i], by_node[topology.nodes[i]]/(float)GB);
+    return buf;
+}
+
+// Live metrics on a Unix socket (-s). Clients send one command per line:
+// "json" or "prometheus" gets a snapshot of the last samples, the phase
+// state and the overhead counters, and "subscribe [json|prometheus]" gets
+// one more after every new sample. "GET /metrics" or "GET /json" gets the
+// snapshot as an HTTP/1.0 response, so curl --unix-socket works as well.
+// Snapshots are built from state emu keeps anyway and sent without
+// blocking; a client whose socket is full is dropped rather than waited on.
+#define METRICS_CLIENTS 64
+#define METRICS_LINE_MAX 256
+
+enum metrics_format {METRICS_JSON, METRICS_PROMETHEUS};
+
+struct metrics_client {
+    int fd;
+    bool subscribed;
+    // Request line of an HTTP request whose headers are still coming
+    bool http;
+    enum metrics_format format;
+    size_t len;
+    char line[METRICS_LINE_MAX];
+};
+
+struct metrics {
+    const char *path;
+    int listenfd;
+    struct metrics_client client[METRICS_CLIENTS];
+    // Bytes per node of the last emulation sample
+    long long by_node[NODES_MAX];
+    // Samples already pushed to subscribers
+    uint64_t pushed;
+};
+
+static struct metrics metrics = {.listenfd = -1};
+
+// Quoted for JSON and Prometheus labels alike, control characters dropped
+static void metrics_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void metrics_json(FILE *f)
+{
+    const struct emulog_record *n = &sample_log.last_nodes;
+    const struct emulog_record *m = &sample_log.last_memprof;
+    const double page = sample_log.page_size;
+    double now = get_time();
+
+    fprintf(f, "{\"rank\":%d,\"time\":%.6f,\"samples\":%llu",
+            sample_log.rank, now, (unsigned long long)sample_log.count);
+
+    if (n->flags & EMULOG_NODES) {
+        uint64_t pages = n->node_pages[0] + n->node_pages[1];
+        fprintf(f, ",\"emulation\":{\"time\":%.6f,\"local_bytes\":%.0f,\"remote_bytes\":%.0f,"
+                "\"local_ratio\":%.6f,\"nodes\":{",
+                n->time, n->node_pages[0] * page, n->node_pages[1] * page,
+                pages ? (double)n->node_pages[0] / pages : 0);
+        for (int i = 0; i < topology.n; i++)
+            fprintf(f, "%s\"%d\":%lld", i ? "," : "", topology.nodes[i],
+                    metrics.by_node[topology.nodes[i]]);
+        fprintf(f, "}}");
+    }
+
+    if (m->flags & EMULOG_MEMPROF)
+        fprintf(f, ",\"profiling\":{\"time\":%.6f,\"rss_bytes\":%llu,\"pss_bytes\":%llu,"
+                "\"referenced_bytes\":%llu,\"anon_bytes\":%llu}",
+                m->time, (unsigned long long)m->rss_kb * KB, (unsigned long long)m->pss_kb * KB,
+                (unsigned long long)m->ref_kb * KB, (unsigned long long)m->anon_kb * KB);
+
+    fprintf(f, ",\"phase\":{\"matches\":%u,\"current\":", sample_log.phase);
+    if (markers.current >= 0) {
+        metrics_string(f, markers.phase[markers.current].name);
+        fprintf(f, ",\"seconds\":%.6f", now - markers.start);
+    } else {
+        fprintf(f, "null");
+    }
+    fprintf(f, ",\"phases\":{");
+    for (int i = 0; i < markers.nphases; i++) {
+        const struct phase_stats *p = &markers.phase[i];
+        fprintf(f, "%s", i ? "," : "");
+        metrics_string(f, p->name);
+        fprintf(f, ":{\"count\":%d,\"seconds\":%.6f}", p->count, p->time);
+    }
+    fprintf(f, "}}");
+
+    fprintf(f, ",\"overhead\":{");
+    bool first = true;
+    for (int i = 0; i < OVERHEAD_STEPS; i++) {
+        if (!overhead.count[i])
+            continue;
+        fprintf(f, "%s\"%s\":{\"count\":%ld,\"seconds\":%.6f,\"max_seconds\":%.6f}",
+                first ? "" : ",", overhead_names[i], overhead.count[i],
+                overhead.total[i], overhead.max[i]);
+        first = false;
+    }
+
+    struct rusage ru;
+    PERR(getrusage(RUSAGE_SELF, &ru) < 0, "emu: getrusage");
+    fprintf(f, "},\"cpu\":{\"user_seconds\":%.6f,\"system_seconds\":%.6f}}\n",
+            ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec,
+            ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec);
+}
+
+static void metrics_prom_type(FILE *f, const char *name, const char *type)
+{
+    fprintf(f, "# TYPE emu_%s %s\n", name, type);
+}
+
+// A sample with the rank label, and the label name="value" if name is set
+static void metrics_prom(FILE *f, const char *name, const char *label, const char *value, double v)
+{
+    fprintf(f, "emu_%s{rank=\"%d\"", name, sample_log.rank);
+    if (label) {
+        fprintf(f, ",%s=", label);
+        metrics_string(f, value);
+    }
+    fprintf(f, "} %.15g\n", v);
+}
+
+static void metrics_prometheus(FILE *f)
+{
+    const struct emulog_record *n = &sample_log.last_nodes;
+    const struct emulog_record *m = &sample_log.last_memprof;
+    const double page = sample_log.page_size;
+    double now = get_time();
+    char node[16];
+
+    metrics_prom_type(f, "uptime_seconds", "gauge");
+    metrics_prom(f, "uptime_seconds", NULL, NULL, now);
+    metrics_prom_type(f, "samples_total", "counter");
+    metrics_prom(f, "samples_total", NULL, NULL, sample_log.count);
+
+    if (n->flags & EMULOG_NODES) {
+        metrics_prom_type(f, "emulation_sample_time_seconds", "gauge");
+        metrics_prom(f, "emulation_sample_time_seconds", NULL, NULL, n->time);
+        metrics_prom_type(f, "local_bytes", "gauge");
+        metrics_prom(f, "local_bytes", NULL, NULL, n->node_pages[0] * page);
+        metrics_prom_type(f, "remote_bytes", "gauge");
+        metrics_prom(f, "remote_bytes", NULL, NULL, n->node_pages[1] * page);
+        metrics_prom_type(f, "node_bytes", "gauge");
+        for (int i = 0; i < topology.n; i++) {
+            snprintf(node, sizeof(node), "%d", topology.nodes[i]);
+            metrics_prom(f, "node_bytes", "node", node, metrics.by_node[topology.nodes[i]]);
+        }
+    }
+
+    if (m->flags & EMULOG_MEMPROF) {
+        metrics_prom_type(f, "profiling_sample_time_seconds", "gauge");
+        metrics_prom(f, "profiling_sample_time_seconds", NULL, NULL, m->time);
+        metrics_prom_type(f, "rss_bytes", "gauge");
+        metrics_prom(f, "rss_bytes", NULL, NULL, (double)m->rss_kb * KB);
+        metrics_prom_type(f, "pss_bytes", "gauge");
+        metrics_prom(f, "pss_bytes", NULL, NULL, (double)m->pss_kb * KB);
+        metrics_prom_type(f, "referenced_bytes", "gauge");
+        metrics_prom(f, "referenced_bytes", NULL, NULL, (double)m->ref_kb * KB);
+        metrics_prom_type(f, "anon_bytes", "gauge");
+        metrics_prom(f, "anon_bytes", NULL, NULL, (double)m->anon_kb * KB);
+    }
+
+    metrics_prom_type(f, "phase_matches_total", "counter");
+    metrics_prom(f, "phase_matches_total", NULL, NULL, sample_log.phase);
+    if (markers.current >= 0) {
+        metrics_prom_type(f, "phase_current_seconds", "gauge");
+        metrics_prom(f, "phase_current_seconds", "phase",
+                markers.phase[markers.current].name, now - markers.start);
+    }
+    if (markers.nphases) {
+        metrics_prom_type(f, "phase_count_total", "counter");
+        for (int i = 0; i < markers.nphases; i++)
+            metrics_prom(f, "phase_count_total", "phase", markers.phase[i].name,
+                    markers.phase[i].count);
+        metrics_prom_type(f, "phase_seconds_total", "counter");
+        for (int i = 0; i < markers.nphases; i++)
+            metrics_prom(f, "phase_seconds_total", "phase", markers.phase[i].name,
+                    markers.phase[i].time);
+    }
+
+    metrics_prom_type(f, "overhead_count_total", "counter");
+    for (int i = 0; i < OVERHEAD_STEPS; i++) {
+        if (overhead.count[i])
+            metrics_prom(f, "overhead_count_total", "step", overhead_names[i], overhead.count[i]);
+    }
+    metrics_prom_type(f, "overhead_seconds_total", "counter");
+    for (int i = 0; i < OVERHEAD_STEPS; i++) {
+        if (overhead.count[i])
+            metrics_prom(f, "overhead_seconds_total", "step", overhead_names[i], overhead.total[i]);
+    }
+
+    struct rusage ru;
+    PERR(getrusage(RUSAGE_SELF, &ru) < 0, "emu: getrusage");
+    metrics_prom_type(f, "cpu_seconds_total", "counter");
+    metrics_prom(f, "cpu_seconds_total", "mode", "user",
+            ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec);
+    metrics_prom(f, "cpu_seconds_total", "mode", "system",
+            ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec);
+
+    // A comment to Prometheus, the end of a snapshot to subscribers
+    fprintf(f, "# EOF\n");
+}
+
+// Snapshot in a buffer to be freed by the caller, with an HTTP header
+static char *metrics_render(enum metrics_format format, bool http, size_t *len)
+{
+    char *body = NULL, *buf = NULL;
+    size_t body_len = 0;
+
+    FILE *f = open_memstream(&body, &body_len);
+    PERR(!f, "emu: metrics snapshot");
+    if (format == METRICS_JSON)
+        metrics_json(f);
+    else
+        metrics_prometheus(f);
+    PERR(fclose(f), "emu: metrics snapshot");
+
+    if (!http) {
+        *len = body_len;
+        return body;
+    }
+
+    f = open_memstream(&buf, len);
+    PERR(!f, "emu: metrics snapshot");
+    fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+            format == METRICS_JSON ? "application/json" : "text/plain; version=0.0.4",
+            body_len);
+    fwrite(body, 1, body_len, f);
+    PERR(fclose(f), "emu: metrics snapshot");
+    free(body);
+    return buf;
+}
+
+static void metrics_drop(struct metrics_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Whole buffer or nothing, never waiting for the client
+static bool metrics_send(struct metrics_client *c, const char *buf, size_t len)
+{
+    ssize_t n = send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t)len)
+        return true;
+
+    if (n >= 0 || errno == EAGAIN)
+        fprintf(stderr, "emu: warning: metrics: dropping client that is not reading\n");
+    metrics_drop(c);
+    return false;
+}
+
+static void metrics_snapshot(struct metrics_client *c, bool http)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t len;
+    char *buf = metrics_render(c->format, http, &len);
+    metrics_send(c, buf, len);
+    free(buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_METRICS, timespec_diff(&t0, &t1));
+}
+
+static bool metrics_parse_format(const char *s, enum metrics_format *format)
+{
+    if (!*s || strcmp(s, "json") == 0)
+        *format = METRICS_JSON;
+    else if (strcmp(s, "prometheus") == 0)
+        *format = METRICS_PROMETHEUS;
+    else
+        return false;
+    return true;
+}
+
+// Returns false once the client is closed
+static bool metrics_command(struct metrics_client *c, char *line)
+{
+    line[strcspn(line, "\r")] = '\0';
+
+    // The reply goes out after the headers, which are ignored, so that
+    // closing the connection doesn't discard unread request bytes
+    if (c->http) {
+        if (*line)
+            return true;
+        metrics_snapshot(c, true);
+        if (c->fd >= 0)
+            metrics_drop(c);
+        return false;
+    }
+
+    const char *reply = NULL;
+    if (strncmp(line, "GET ", 4) == 0) {
+        const char *path = line + 4;
+        size_t len = strcspn(path, " ?");
+        if (len == 8 && strncmp(path, "/metrics", 8) == 0) {
+            c->format = METRICS_PROMETHEUS;
+        } else if (len == 5 && strncmp(path, "/json", 5) == 0) {
+            c->format = METRICS_JSON;
+        } else {
+            reply = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+            metrics_send(c, reply, strlen(reply));
+            if (c->fd >= 0)
+                metrics_drop(c);
+            return false;
+        }
+        c->http = true;
+    } else if (*line && metrics_parse_format(line, &c->format)) {
+        metrics_snapshot(c, false);
+    } else if (strncmp(line, "subscribe", 9) == 0 && (!line[9] || line[9] == ' ') &&
+            metrics_parse_format(line + 9 + (line[9] == ' '), &c->format)) {
+        c->subscribed = true;
+        metrics_snapshot(c, false);
+    } else {
+        reply = "error: expected 'json', 'prometheus' or 'subscribe [json|prometheus]'\n";
+        metrics_send(c, reply, strlen(reply));
+    }
+    return c->fd >= 0;
+}
+
+static void metrics_read(struct metrics_client *c)
+{
+    ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+    if (n <= 0) {
+        if (n == 0 || errno != EAGAIN)
+            metrics_drop(c);
+        return;
+    }
+    c->len += n;
+
+    char *line = c->line, *end;
+    while ((end = memchr(line, '\n', c->line + c->len - line))) {
+        *end = '\0';
+        if (!metrics_command(c, line))
+            return;
+        line = end + 1;
+    }
+
+    c->len -= line - c->line;
+    memmove(c->line, line, c->len);
+    if (c->len == sizeof(c->line) - 1) {
+        fprintf(stderr, "emu: warning: metrics: dropping client with a too long line\n");
+        metrics_drop(c);
+    }
+}
+
+void metrics_init(struct metrics *m, const char *path, int epfd)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "emu: socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    m->path = path;
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        m->client[i].fd = -1;
+
+    m->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    PERR(m->listenfd < 0, "emu: metrics socket");
+    PERR(bind(m->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0, "emu: bind metrics socket");
+    PERR(listen(m->listenfd, 16) < 0, "emu: listen on metrics socket");
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = m->listenfd;
+    PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, m->listenfd, &ev) < 0, "emu: add metrics socket to epoll");
+}
+
+// Handle an epoll event, returns false if fd is not ours
+bool metrics_handle(struct metrics *m, int fd, int epfd)
+{
+    if (m->listenfd < 0)
+        return false;
+
+    if (fd == m->listenfd) {
+        int client = accept4(m->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0)
+            return true;
+
+        int i = 0;
+        while (i < METRICS_CLIENTS && m->client[i].fd >= 0)
+            i++;
+        if (i == METRICS_CLIENTS) {
+            fprintf(stderr, "emu: warning: too many metrics connections\n");
+            close(client);
+            return true;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = client;
+        PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0, "emu: add metrics client to epoll");
+        memset(&m->client[i], 0, sizeof(m->client[i]));
+        m->client[i].fd = client;
+        return true;
+    }
+
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        if (m->client[i].fd == fd) {
+            metrics_read(&m->client[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send a snapshot to the subscribers if there was a sample since the last
+// call. Each format is rendered once for all of them.
+void metrics_push(struct metrics *m)
+{
+    if (m->listenfd < 0 || m->pushed == sample_log.count)
+        return;
+    m->pushed = sample_log.count;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char *buf[2] = {};
+    size_t len[2];
+    bool sent = false;
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        struct metrics_client *c = &m->client[i];
+        if (c->fd < 0 || !c->subscribed)
+            continue;
+        if (!buf[c->format])
+            buf[c->format] = metrics_render(c->format, false, &len[c->format]);
+        metrics_send(c, buf[c->format], len[c->format]);
+        sent = true;
+    }
+    free(buf[0]);
+    free(buf[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (sent)
+        overhead_add(OVERHEAD_METRICS, timespec_diff(&t0, &t1));
+}
+
+void metrics_destroy(struct metrics *m)
+{
+    if (m->listenfd < 0)
+        return;
+
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        if (m->client[i].fd >= 0)
+            close(m->client[i].fd);
+    }
+    close(m->listenfd);
+    unlink(m->path);
+    m->listenfd = -1;
+}
+
+// Mapped bytes per node by page size. hugetlb mappings are marked in
+// numa_maps, but transparent huge pages are counted there as base pages,
+// so the THP part of each mapping comes from smaps.
+struct page_sizes {
+    long long base[2];
+    long long thp[2];
+    long long hugetlb[2];
+    // hugetlb pages are not known, their columns are left out
+    bool no_hugetlb;
+};
+
+struct thp_vma {
+    unsigned long start;
+    long long bytes;
+};
+
+struct numa_maps {
+    struct procfile file;
+    // Local and remote
+    long long node_bytes[2];
+    long long by_node[NODES_MAX];
+    double parse_time;
+    // With -P. The full smaps is read every sample, a walk of the page
+    // tables as costly as that of numa_maps.
+    bool page_sizes;
+    struct procfile smaps;
+    struct thp_vma *thp;
+    size_t nthp, thp_cap;
+    struct page_sizes sizes;
+};
+
+void numa_maps_init(struct numa_maps *nm, int pid, bool page_sizes)
+{
+    memset(nm, 0, sizeof(*nm));
+    procfile_init(&nm->file, pid, "numa_maps");
+    nm->page_sizes = page_sizes;
+    if (page_sizes)
+        procfile_init(&nm->smaps, pid, "smaps");
+}
+
+void numa_maps_close(struct numa_maps *nm)
+{
+    procfile_close(&nm->file);
+    procfile_close(&nm->smaps);
+    free(nm->thp);
+    nm->thp = NULL;
+    nm->nthp = nm->thp_cap = 0;
+}
+
+// Collect the mappings with huge pages from smaps, in address order like
+// numa_maps.
+static void numa_maps_parse_thp(struct numa_maps *nm)
+{
+    char *p = nm->smaps.buf;
+    unsigned long start = 0;
+
+    nm->nthp = 0;
+
+    while (p && *p) {
+        long long kb;
+        char *next = strchr(p, '\n');
+
+        if (isxdigit(*p) && strchr(p, '-') < (next ? next : p + strlen(p))) {
+            start = strtoul(p, NULL, 16);
+        } else if (sscanf(p, "AnonHugePages: %lld kB", &kb) == 1 ||
+                sscanf(p, "ShmemPmdMapped: %lld kB", &kb) == 1 ||
+                sscanf(p, "FilePmdMapped: %lld kB", &kb) == 1) {
+            if (kb > 0) {
+                if (nm->nthp && nm->thp[nm->nthp-1].start == start) {
+                    nm->thp[nm->nthp-1].bytes += kb * KB;
+                } else {
+                    if (nm->nthp == nm->thp_cap) {
+                        nm->thp_cap = nm->thp_cap ? 2*nm->thp_cap : 64;
+                        nm->thp = realloc(nm->thp, nm->thp_cap * sizeof(*nm->thp));
+                        PERR(!nm->thp, "emu: thp mappings");
+                    }
+                    nm->thp[nm->nthp].start = start;
+                    nm->thp[nm->nthp].bytes = kb * KB;
+                    nm->nthp++;
+                }
+            }
+        }
+
+        p = next ? next + 1 : NULL;
+    }
+}
+
+// Parts borrowed from numastat (GPL)
+static void numa_maps_parse(struct numa_maps *nm)
+{
+    const long base_kb = numa_pagesize() / KB;
+    char *p = nm->file.buf;
+    char *end = nm->file.buf + nm->file.len;
+
+    size_t thp_i = 0;
+
+    nm->node_bytes[0] = nm->node_bytes[1] = 0;
+    memset(nm->by_node, 0, sizeof(nm->by_node));
+    memset(&nm->sizes, 0, sizeof(nm->sizes));
+
+    while (p < end) {
+        long long line_pages[2] = {};
+        // Pages of the line on each node of the sets
+        int line_node[NODES_MAX];
+        long line_node_pages[NODES_MAX];
+        int nline = 0;
+        long page_kb = base_kb;
+        bool huge = false;
+        unsigned long start = strtoul(p, NULL, 16);
+
+        // Tokens of one line (one VMA). The page size comes last, so node
+        // counts are collected first and scaled at the end of the line.
+        while (p < end && *p != '\n') {
+            while (*p == ' ' || *p == '\t')
+                p++;
+
+            if (p[0] == 'N' && isdigit(p[1])) {
+                int node = (int)strtol(&p[1], &p, 10);
+                if (p[0] != '=') {
+                    fprintf(stderr, "emu: show_stats: node value parse error\n");
+                    exit(EXIT_FAILURE);
+                }
+                long pages = strtol(&p[1], &p, 10);
+                int side = topology_account(node);
+                if (side >= 0 && nline < NODES_MAX) {
+                    line_pages[side] += pages;
+                    line_node[nline] = node;
+                    line_node_pages[nline++] = pages;
+                }
+            } else if (strncmp(p, "kernelpagesize_kB=", 18) == 0) {
+                page_kb = strtol(p + 18, &p, 10);
+            } else if (strncmp(p, "huge", 4) == 0 && isspace(p[4])) {
+                huge = true;
+            }
+
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\n')
+                p++;
+        }
+        p++;
+
+        long long bytes[2] = {
+            line_pages[0] * page_kb * KB,
+            line_pages[1] * page_kb * KB,
+        };
+        nm->node_bytes[0] += bytes[0];
+        nm->node_bytes[1] += bytes[1];
+        for (int i = 0; i < nline; i++)
+            nm->by_node[line_node[i]] += line_node_pages[i] * page_kb * KB;
+
+        if (!nm->page_sizes)
+            continue;
+
+        if (huge) {
+            nm->sizes.hugetlb[0] += bytes[0];
+            nm->sizes.hugetlb[1] += bytes[1];
+            continue;
+        }
+
+        // smaps has no per-node split, so the huge pages of a mapping are
+        // split like its pages. This is exact for mappings on one node.
+        long long thp = 0;
+        while (thp_i < nm->nthp && nm->thp[thp_i].start < start)
+            thp_i++;
+        if (thp_i < nm->nthp && nm->thp[thp_i].start == start)
+            thp = nm->thp[thp_i].bytes;
+
+        long long total = bytes[0] + bytes[1];
+        if (thp > total)
+            thp = total;
+        for (int n = 0; n < 2; n++) {
+            long long node_thp = total ? (long long)((double)thp * bytes[n] / total) : 0;
+            nm->sizes.thp[n] += node_thp;
+            nm->sizes.base[n] += bytes[n] - node_thp;
+        }
+    }
+}
+
+// Print a sample line. Lines for single processes of a tree are prefixed
+// with their pid, the summary line (pid 0) is not.
+static void emu_print_stats(int pid, const long long node_bytes[2],
+        const long long *by_node, double sample_time, const char *extra)
+{
+    long long total = node_bytes[0] + node_bytes[1];
+    float local_frac = node_bytes[0] / (float)total;
+    if (pid) {
+        printf("emu: pid %d ", pid);
+    } else {
+        printf("emu: ");
+
+        struct emulog_record rec = {};
+        rec.flags = EMULOG_NODES;
+        rec.node_pages[0] = node_bytes[0] / sample_log.page_size;
+        rec.node_pages[1] = node_bytes[1] / sample_log.page_size;
+        memcpy(metrics.by_node, by_node, sizeof(metrics.by_node));
+        sample_log_write(&rec);
+    }
+    printf("local%% %3.2f localGB %.2f remoteGB %.2f totalGB %.2f time %.*f parsems %.3f%s%s%s%s\n",
+            100.0f * local_frac,
+            node_bytes[0]/(float)GB,
+            node_bytes[1]/(float)GB,
+            total/(float)GB,
+	        time_digits, get_time(),
+            1e3 * sample_time, topology_columns(by_node),
+            extra, pid ? "" : overhead_column(), pid ? "" : perf_column());
+}
+
+static bool numa_maps_sample(struct numa_maps *nm)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (nm->page_sizes) {
+        if (!procfile_read(&nm->smaps))
+            return false;
+        numa_maps_parse_thp(nm);
+    }
+
+    if (!procfile_read(&nm->file))
+        return false;
+    numa_maps_parse(nm);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    nm->parse_time = timespec_diff(&t0, &t1);
+    overhead_add(OVERHEAD_NUMA_MAPS, nm->parse_time);
+    return true;
+}
+
+static long hugetlb_page_kb(void)
+{
+    long kb = 0;
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+        return 0;
+    while (fgets(tmp, sizeof(tmp), fp)) {
+        if (sscanf(tmp, "Hugepagesize: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+// Columns for a page size breakdown, empty without -P
+static const char *page_sizes_format(const struct page_sizes *s, bool enabled)
+{
+    static char buf[256];
+
+    buf[0] = '\0';
+    if (!enabled)
+        return buf;
+
+    int len = snprintf(buf, sizeof(buf),
+            " localbaseGB %.2f remotebaseGB %.2f localthpGB %.2f remotethpGB %.2f",
+            s->base[0]/(float)GB, s->base[1]/(float)GB,
+            s->thp[0]/(float)GB, s->thp[1]/(float)GB);
+    if (!s->no_hugetlb)
+        snprintf(buf + len, sizeof(buf) - len, " localhugetlbGB %.2f remotehugetlbGB %.2f",
+                s->hugetlb[0]/(float)GB, s->hugetlb[1]/(float)GB);
+    return buf;
+}
+
+void emu_show_stats(struct numa_maps *nm)
+{
+    numa_maps_sample(nm);
+    emu_print_stats(0, nm->node_bytes, nm->by_node, nm->parse_time,
+            page_sizes_format(&nm->sizes, nm->page_sizes));
+}
+
+// System-wide huge page state of the local and far nodes, to compare the
+// huge page coverage of the target in local and remote memory. The
+// reservation of local memory is included in the local nodes.
+void emu_show_node_huge_pages(void)
+{
+    long long thp[2] = {}, hugetlb[2] = {}, hugetlb_free[2] = {};
+    long page_kb = hugetlb_page_kb();
+
+    for (int i = 0; i < topology.n; i++) {
+        int node = topology.nodes[i];
+        int side = topology.side[node];
+        char fname[64];
+        snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/meminfo", node);
+
+        FILE *fp = fopen(fname, "r");
+        if (!fp)
+            continue;
+
+        while (fgets(tmp, sizeof(tmp), fp)) {
+            int n;
+            long long v;
+            if (sscanf(tmp, "Node %d AnonHugePages: %lld kB", &n, &v) == 2)
+                thp[side] += v * KB;
+            else if (sscanf(tmp, "Node %d HugePages_Total: %lld", &n, &v) == 2)
+                hugetlb[side] += v * page_kb * KB;
+            else if (sscanf(tmp, "Node %d HugePages_Free: %lld", &n, &v) == 2)
+                hugetlb_free[side] += v * page_kb * KB;
+        }
+        fclose(fp);
+    }
+
+    printf("emu: nodes localthpGB %.2f remotethpGB %.2f localhugetlbGB %.2f remotehugetlbGB %.2f"
+            " localhugetlbfreeGB %.2f remotehugetlbfreeGB %.2f time %.*f\n",
+            thp[0]/(float)GB, thp[1]/(float)GB,
+            hugetlb[0]/(float)GB, hugetlb[1]/(float)GB,
+            hugetlb_free[0]/(float)GB, hugetlb_free[1]/(float)GB,
+            time_digits, get_time());
+}
+
+// cgroup v2 backend. The target runs in its own leaf cgroup below a parent
+// given with -c, so per-node usage comes from memory.numa_stat at a cost that
+// does not depend on the footprint, and includes every thread and process
+// the target starts.
+#define CGROUP_HUGETLB_SIZES 4
+
+struct cgroup {
+    char path[PATH_MAX];
+    bool cpuset;
+    int numa_stat_fd;
+    int stat_fd;
+    char *buf;
+    size_t size;
+    long long node_bytes[2];
+    long long by_node[NODES_MAX];
+    long long anon, file;
+    double sample_time;
+    // With -P, hugetlb pages are not charged to the memory controller and
+    // come from the hugetlb.<size>.numa_stat of each huge page size
+    bool page_sizes;
+    struct page_sizes sizes;
+    bool hugetlb;
+    int hugetlb_fd[CGROUP_HUGETLB_SIZES];
+    int nhugetlb;
+};
+
+static bool cgroup_has_controller(const char *dir, const char *file, const char *name)
+{
+    char fname[PATH_MAX + 32];
+    snprintf(fname, sizeof(fname), "%s/%s", dir, file);
+
+    FILE *fp = fopen(fname, "r");
+    if (!fp)
+        return false;
+
+    bool found = false;
+    while (fscanf(fp, "%63s", tmp) == 1) {
+        if (strcmp(tmp, name) == 0)
+            found = true;
+    }
+    fclose(fp);
+
+    return found;
+}
+
+static void cgroup_write(const struct cgroup *cg, const char *file, const char *val)
+{
+    char fname[PATH_MAX + 32];
+    snprintf(fname, sizeof(fname), "%s/%s", cg->path, file);
+
+    int fd = open(fname, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, val, strlen(val)) < 0) {
+        char msg[PATH_MAX + 256];
+        snprintf(msg, sizeof(msg), "emu: cgroup: can't write '%s' to '%s'", val, fname);
+        perror(msg);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static int cgroup_open(const struct cgroup *cg, const char *file)
+{
+    char fname[PATH_MAX + 32];
+    snprintf(fname, sizeof(fname), "%s/%s", cg->path, file);
+
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "emu: cgroup: can't open '%s'", fname);
+        perror(msg);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Format a node or cpu mask in the list syntax used by cpuset files.
+static void bitmask_to_list(const struct bitmask *bm, char *buf, size_t n)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+
+    for (unsigned int i = 0; i < bm->size; i++) {
+        if (!numa_bitmask_isbitset(bm, i))
+            continue;
+
+        unsigned int j = i;
+        while (j + 1 < bm->size && numa_bitmask_isbitset(bm, j + 1))
+            j++;
+
+        if (j == i)
+            len += snprintf(buf + len, n - len, "%s%u", len ? "," : "", i);
+        else
+            len += snprintf(buf + len, n - len, "%s%u-%u", len ? "," : "", i, j);
+
+        if (len >= n) {
+            fprintf(stderr, "emu: cpu list too long\n");
+            exit(EXIT_FAILURE);
+        }
+        i = j;
+    }
+}
+
+void cgroup_create(struct cgroup *cg, const char *parent)
+{
+    memset(cg, 0, sizeof(*cg));
+    cg->numa_stat_fd = -1;
+    cg->stat_fd = -1;
+
+    if (!cgroup_has_controller(parent, "cgroup.controllers", "memory")) {
+        fprintf(stderr, "emu: cgroup: memory controller not available in '%s'\n", parent);
+        exit(EXIT_FAILURE);
+    }
+
+    // Enable controllers for the leaf, unless the parent already does
+    char fname[PATH_MAX + 32];
+    snprintf(fname, sizeof(fname), "%s/cgroup.subtree_control", parent);
+    const char *controllers[] = {"memory", "cpuset", "hugetlb"};
+    for (int i = 0; i < 3; i++) {
+        if (cgroup_has_controller(parent, "cgroup.subtree_control", controllers[i]))
+            continue;
+
+        int fd = open(fname, O_WRONLY | O_CLOEXEC);
+        snprintf(tmp, sizeof(tmp), "+%s", controllers[i]);
+        if (fd < 0 || write(fd, tmp, strlen(tmp)) < 0) {
+            if (i == 0) {
+                sprintf(tmp, "emu: cgroup: can't enable memory controller in '%s'", parent);
+                perror(tmp);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    cg->cpuset = cgroup_has_controller(parent, "cgroup.subtree_control", "cpuset");
+    cg->hugetlb = cgroup_has_controller(parent, "cgroup.subtree_control", "hugetlb");
+
+    snprintf(cg->path, sizeof(cg->path), "%s/emu.%d", parent, getpid());
+    if (mkdir(cg->path, 0755) < 0) {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "emu: cgroup: can't create '%s'", cg->path);
+        perror(msg);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!cg->cpuset)
+        fprintf(stderr, "emu: warning: cgroup: cpuset controller not available, using libnuma\n");
+
+    printf("emu: cgroup %s\n", cg->path);
+}
+
+// Restrict the leaf to the CPUs of the local nodes and the given memory nodes.
+void cgroup_set_cpuset(struct cgroup *cg, const struct bitmask *mems)
+{
+    static char list[4096];
+
+    struct bitmask *cpus = topology_cpus();
+    bitmask_to_list(cpus, list, sizeof(list));
+    cgroup_write(cg, "cpuset.cpus", list);
+    numa_free_cpumask(cpus);
+
+    bitmask_to_list(mems, list, sizeof(list));
+    cgroup_write(cg, "cpuset.mems", list);
+}
+
+// Called in the child before exec, so that all descendants are included.
+void cgroup_enter(struct cgroup *cg)
+{
+    cgroup_write(cg, "cgroup.procs", "0");
+}
+
+// Files are named after the huge page size as the kernel formats it, like
+// hugetlb.2MB.numa_stat. They need Linux 5.12.
+static void cgroup_open_hugetlb(struct cgroup *cg)
+{
+    DIR *dir = cg->hugetlb ? opendir("/sys/kernel/mm/hugepages") : NULL;
+    struct dirent *de;
+    while (dir && (de = readdir(dir)) && cg->nhugetlb < CGROUP_HUGETLB_SIZES) {
+        unsigned long kb;
+        if (sscanf(de->d_name, "hugepages-%lukB", &kb) != 1)
+            continue;
+
+        char size[32], fname[PATH_MAX + 64];
+        if (kb >= 1024*1024)
+            snprintf(size, sizeof(size), "%luGB", kb / (1024*1024));
+        else if (kb >= 1024)
+            snprintf(size, sizeof(size), "%luMB", kb / 1024);
+        else
+            snprintf(size, sizeof(size), "%luKB", kb);
+        snprintf(fname, sizeof(fname), "%s/hugetlb.%s.numa_stat", cg->path, size);
+
+        int fd = open(fname, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            while (cg->nhugetlb > 0)
+                close(cg->hugetlb_fd[--cg->nhugetlb]);
+            cg->hugetlb = false;
+            break;
+        }
+        cg->hugetlb_fd[cg->nhugetlb++] = fd;
+    }
+    if (dir)
+        closedir(dir);
+
+    if (!cg->hugetlb)
+        fprintf(stderr, "emu: warning: cgroup: hugetlb numa_stat not available, hugetlb pages are not reported\n");
+    cg->sizes.no_hugetlb = !cg->hugetlb;
+}
+
+// Add the "N0=bytes N1=bytes ..." of a numa_stat line to the local and
+// remote sums, and per node if by_node is given
+static void cgroup_parse_nodes(char *line, long long *sum, long long *by_node)
+{
+    for (char *p = strchr(line, 'N'); p; p = strchr(p, 'N')) {
+        int node = (int)strtol(&p[1], &p, 10);
+        if (p[0] != '=') {
+            fprintf(stderr, "emu: cgroup: numa_stat parse error\n");
+            exit(EXIT_FAILURE);
+        }
+        long long bytes = strtoll(&p[1], &p, 10);
+        int side = bytes ? topology_account(node) : topology_side(node);
+        if (side >= 0) {
+            sum[side] += bytes;
+            if (by_node)
+                by_node[node] += bytes;
+        }
+    }
+}
+
+void cgroup_show_stats(struct cgroup *cg)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (cg->numa_stat_fd < 0) {
+        cg->numa_stat_fd = cgroup_open(cg, "memory.numa_stat");
+        cg->stat_fd = cgroup_open(cg, "memory.stat");
+        if (cg->page_sizes)
+            cgroup_open_hugetlb(cg);
+    }
+
+    // Lines look like "anon N0=bytes N1=bytes ...". Mapped memory of the
+    // target is anon plus file_mapped, which includes mapped shmem. file
+    // would add all page cache charged to the cgroup, mapped or not. The
+    // *_thp lines are the huge page parts of anon and shmem, shmem huge
+    // pages that are not mapped can make them exceed the mapped bytes.
+    long long thp[2] = {};
+    cg->node_bytes[0] = cg->node_bytes[1] = 0;
+    memset(cg->by_node, 0, sizeof(cg->by_node));
+    pread_all(cg->numa_stat_fd, &cg->buf, &cg->size, "memory.numa_stat");
+    for (char *line = cg->buf; line && *line; ) {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        long long *sum = NULL, *by_node = NULL;
+        if (strncmp(line, "anon ", 5) == 0 || strncmp(line, "file_mapped ", 12) == 0) {
+            sum = cg->node_bytes;
+            by_node = cg->by_node;
+        }
+        else if (strncmp(line, "anon_thp ", 9) == 0 || strncmp(line, "shmem_thp ", 10) == 0)
+            sum = thp;
+
+        if (sum)
+            cgroup_parse_nodes(line, sum, by_node);
+
+        line = next;
+    }
+
+    // The first line, "total=bytes N0=bytes ...", is the leaf itself
+    long long hugetlb[2] = {};
+    for (int i = 0; i < cg->nhugetlb; i++) {
+        pread_all(cg->hugetlb_fd[i], &cg->buf, &cg->size, "hugetlb numa_stat");
+        cg->buf[strcspn(cg->buf, "\n")] = '\0';
+        cgroup_parse_nodes(cg->buf, hugetlb, NULL);
+    }
+
+    pread_all(cg->stat_fd, &cg->buf, &cg->size, "memory.stat");
+    for (char *line = cg->buf; line && *line; ) {
+        sscanf(line, "anon %lld", &cg->anon);
+        sscanf(line, "file %lld", &cg->file);
+
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    cg->sample_time = timespec_diff(&t0, &t1);
+    overhead_add(OVERHEAD_CGROUP, cg->sample_time);
+
+    for (int node = 0; node < 2; node++) {
+        cg->sizes.thp[node] = thp[node] < cg->node_bytes[node] ? thp[node] : cg->node_bytes[node];
+        cg->sizes.base[node] = cg->node_bytes[node] - cg->sizes.thp[node];
+        cg->sizes.hugetlb[node] = hugetlb[node];
+    }
+
+    char extra[320];
+    snprintf(extra, sizeof(extra), " anonGB %.2f fileGB %.2f%s",
+            cg->anon/(float)GB, cg->file/(float)GB,
+            page_sizes_format(&cg->sizes, cg->page_sizes));
+    emu_print_stats(0, cg->node_bytes, cg->by_node, cg->sample_time, extra);
+}
+
+void cgroup_destroy(struct cgroup *cg)
+{
+    if (cg->numa_stat_fd >= 0)
+        close(cg->numa_stat_fd);
+    if (cg->stat_fd >= 0)
+        close(cg->stat_fd);
+    for (int i = 0; i < cg->nhugetlb; i++)
+        close(cg->hugetlb_fd[i]);
+
+    // Fails if processes started by the target are still running
+    if (rmdir(cg->path) < 0) {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "emu: warning: cgroup: can't remove '%s'", cg->path);
+        perror(msg);
+    }
+}
+
+// Write to clear_refs: 1 clears referenced bits, 4 clears soft-dirty bits
+bool memprof_clear_refs(int pid, int what, bool required)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/proc/%d/clear_refs", pid);
+    FILE *fp = fopen(fname, "w");
+    if (!fp) {
+        if (!required)
+            return false;
+        sprintf(tmp, "memprof: can't open '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    if (fprintf(fp, "%d\n", what) < 0) {
+        sprintf(tmp, "memprof: can't write to '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    if (fclose(fp)) {
+        if (!required)
+            return false;
+        sprintf(tmp, "memprof: can't close '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_CLEAR_REFS, timespec_diff(&t0, &t1));
+    return true;
+}
+
+struct memprof_stats {
+    size_t rss, pss, ref, anon, dirty;
+    double scan_time;
+};
+
+bool memprof_read(int pid, struct memprof_stats *st, bool required)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/proc/%d/smaps_rollup", pid);
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        if (!required)
+            return false;
+        sprintf(tmp, "memprof: can't open '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(st, 0, sizeof(*st));
+
+    while (fgets(tmp, sizeof(tmp), fp)) {
+        sscanf(tmp, "Rss: %zu kB", &st->rss);
+        sscanf(tmp, "Pss: %zu kB", &st->pss);
+        sscanf(tmp, "Referenced: %zu kB", &st->ref);
+        sscanf(tmp, "Anonymous: %zu kB", &st->anon);
+    }
+
+    if (fclose(fp)) {
+        sprintf(tmp, "memprof: can't close '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_SMAPS_ROLLUP, timespec_diff(&t0, &t1));
+    return true;
+}
+
+// Walk the pagemap entries of every mapping of pid in large batches, calling
+// fn on each batch. Returns false if the process is gone.
+#define PAGEMAP_BATCH 65536
+
+#define PM_PRESENT (1ULL << 63)
+#define PM_SWAP (1ULL << 62)
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_PFN_MASK ((1ULL << 55) - 1)
+
+struct pagemap_walk {
+    uint64_t *entries;
+    char *buf;
+    size_t size;
+    // Mapping and address of the batch passed to fn
+    unsigned long vma_start, vma_end, addr;
+    const char *vma_path;
+};
+
+void pagemap_walk_init(struct pagemap_walk *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->entries = malloc(PAGEMAP_BATCH * sizeof(uint64_t));
+    PERR(!w->entries, "memprof: pagemap buffer");
+}
+
+bool pagemap_walk(struct pagemap_walk *w, int pid, bool required,
+        void (*fn)(void *arg, const uint64_t *entries, size_t n), void *arg)
+{
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    char fname[64];
+
+    snprintf(fname, sizeof(fname), "/proc/%d/maps", pid);
+    int maps_fd = open(fname, O_RDONLY | O_CLOEXEC);
+    snprintf(fname, sizeof(fname), "/proc/%d/pagemap", pid);
+    int pagemap_fd = open(fname, O_RDONLY | O_CLOEXEC);
+
+    if (maps_fd < 0 || pagemap_fd < 0) {
+        if (!required) {
+            if (maps_fd >= 0)
+                close(maps_fd);
+            if (pagemap_fd >= 0)
+                close(pagemap_fd);
+            return false;
+        }
+        sprintf(tmp, "memprof: can't open maps/pagemap of %d", pid);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    pread_all(maps_fd, &w->buf, &w->size, "maps");
+    close(maps_fd);
+
+    for (char *line = w->buf; line && *line; ) {
+        unsigned long start, end;
+        int pathoff = 0;
+
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        bool ok = sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &pathoff) >= 2;
+        if (!ok || strstr(line, "[vsyscall]")) {
+            line = next;
+            continue;
+        }
+        w->vma_start = start;
+        w->vma_end = end;
+        w->vma_path = pathoff ? line + pathoff : "";
+        line = next;
+
+        for (unsigned long addr = start; addr < end; ) {
+            size_t n = (end - addr) / pagesize;
+            if (n > PAGEMAP_BATCH)
+                n = PAGEMAP_BATCH;
+
+            ssize_t got = pread(pagemap_fd, w->entries, n * sizeof(uint64_t),
+                    addr / pagesize * sizeof(uint64_t));
+            if (got <= 0)
+                break;
+            n = got / sizeof(uint64_t);
+
+            w->addr = addr;
+            fn(arg, w->entries, n);
+            addr += n * pagesize;
+        }
+    }
+    close(pagemap_fd);
+
+    return true;
+}
+
+// Idle page tracking. Instead of clearing the accessed bits with clear_refs,
+// which flushes the TLB of the target, the physical pages of the target are
+// looked up in pagemap and marked idle in the page_idle bitmap. A page whose
+// idle bit has been cleared by the next sample was accessed in between.
+// PFNs of anonymous memory are scattered, so the pages of each pagemap batch
+// are grouped by window of IDLE_RUN bitmap words, and each window is read
+// and then marked with one pread and one pwrite. Pages shared between
+// processes of a tree only count as referenced in the first one scanned.
+#define IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+#define IDLE_RUN 512
+#define IDLE_WINDOW_PAGES (64 * IDLE_RUN)
+
+struct idle_page {
+    uint64_t pfn;
+    size_t i;
+};
+
+struct idle_tracker {
+    int bitmap_fd;
+    struct pagemap_walk walk;
+    // Present pages of a batch, and scratch space to sort them
+    struct idle_page *pages, *sorted;
+    // Per entry of the last batch, set if the page was accessed
+    uint8_t *accessed;
+    // Bitmap words of a window as read before marking (vals) and the idle
+    // bits to set (mark)
+    uint64_t mark[IDLE_RUN];
+    uint64_t vals[IDLE_RUN];
+    size_t referenced;
+    // Pages were marked idle by the last sample, no reset needed
+    bool fresh;
+};
+
+void idle_init(struct idle_tracker *it)
+{
+    memset(it, 0, sizeof(*it));
+    it->bitmap_fd = open(IDLE_BITMAP, O_RDWR | O_CLOEXEC);
+    PERR(it->bitmap_fd < 0, "memprof: can't open " IDLE_BITMAP
+            " (needs CONFIG_IDLE_PAGE_TRACKING and root)");
+    pagemap_walk_init(&it->walk);
+    it->pages = malloc(PAGEMAP_BATCH * sizeof(struct idle_page));
+    it->sorted = malloc(PAGEMAP_BATCH * sizeof(struct idle_page));
+    it->accessed = malloc(PAGEMAP_BATCH);
+    PERR(!it->pages || !it->sorted || !it->accessed, "memprof: idle buffers");
+}
+
+// Group pages by window, with an LSD radix sort on the window number. The
+// order within a window doesn't matter.
+static void idle_sort(struct idle_tracker *it, size_t n)
+{
+    uint64_t max = 0;
+    for (size_t i = 0; i < n; i++)
+        max |= it->pages[i].pfn / IDLE_WINDOW_PAGES;
+
+    for (int shift = 0; shift < 64 && (max >> shift); shift += 8) {
+        size_t count[257] = {};
+        for (size_t i = 0; i < n; i++)
+            count[((it->pages[i].pfn / IDLE_WINDOW_PAGES) >> shift & 0xff) + 1]++;
+        for (int b = 1; b <= 256; b++)
+            count[b] += count[b-1];
+        for (size_t i = 0; i < n; i++)
+            it->sorted[count[(it->pages[i].pfn / IDLE_WINDOW_PAGES) >> shift & 0xff]++] = it->pages[i];
+
+        struct idle_page *t = it->pages;
+        it->pages = it->sorted;
+        it->sorted = t;
+    }
+}
+
+// Test the present pages of a pagemap batch and mark them idle again:
+// it->accessed[i] is set if page i was accessed since it was last marked.
+// Pages mapped twice are only counted once. Returns the number accessed.
+static size_t idle_test_and_mark(struct idle_tracker *it, const uint64_t *entries, size_t n)
+{
+    size_t np = 0, count = 0;
+
+    memset(it->accessed, 0, n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t e = entries[i];
+        if (!(e & PM_PRESENT))
+            continue;
+        if (!(e & PM_PFN_MASK)) {
+            fprintf(stderr, "memprof: pagemap has no PFNs, needs CAP_SYS_ADMIN\n");
+            exit(EXIT_FAILURE);
+        }
+        it->pages[np++] = (struct idle_page){e & PM_PFN_MASK, i};
+    }
+    idle_sort(it, np);
+
+    for (size_t a = 0; a < np; ) {
+        uint64_t window = it->pages[a].pfn / IDLE_WINDOW_PAGES;
+        uint64_t lo = UINT64_MAX, hi = 0;
+        size_t b = a;
+        for (; b < np && it->pages[b].pfn / IDLE_WINDOW_PAGES == window; b++) {
+            uint64_t w = it->pages[b].pfn / 64;
+            lo = w < lo ? w : lo;
+            hi = w > hi ? w : hi;
+        }
+
+        // The bitmap ends at the last PFN, so the read may be short
+        size_t bytes = (hi - lo + 1) * sizeof(uint64_t);
+        ssize_t got = pread(it->bitmap_fd, it->vals, bytes, lo * sizeof(uint64_t));
+        PERR(got < 0, "memprof: read " IDLE_BITMAP);
+        memset((char *)it->vals + got, 0, bytes - got);
+        memset(it->mark, 0, bytes);
+
+        for (; a < b; a++) {
+            uint64_t w = it->pages[a].pfn / 64 - lo;
+            uint64_t bit = 1ULL << (it->pages[a].pfn % 64);
+            bool accessed = !(it->vals[w] & bit);
+
+            it->vals[w] |= bit;
+            it->mark[w] |= bit;
+            it->accessed[it->pages[a].i] = accessed;
+            count += accessed;
+        }
+
+        PERR(pwrite(it->bitmap_fd, it->mark, bytes, lo * sizeof(uint64_t)) != (ssize_t)bytes,
+                "memprof: write " IDLE_BITMAP);
+    }
+    return count;
+}
+
+static void idle_batch(void *arg, const uint64_t *entries, size_t n)
+{
+    struct idle_tracker *it = arg;
+
+    it->referenced += idle_test_and_mark(it, entries, n);
+}
+
+// Count pages of pid referenced since the last scan and mark all its pages
+// idle. Returns the number of referenced pages, or -1 if the process is gone.
+long idle_scan(struct idle_tracker *it, int pid, bool required)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    it->referenced = 0;
+    if (!pagemap_walk(&it->walk, pid, required, idle_batch, it))
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_IDLE, timespec_diff(&t0, &t1));
+    return it->referenced;
+}
+
+// Write working set from soft-dirty bits: pages written since the last
+// "4" to clear_refs. Swapped out pages keep their soft-dirty bit.
+struct dirty_tracker {
+    struct pagemap_walk walk;
+    size_t dirty, present;
+    bool checked;
+};
+
+void dirty_init(struct dirty_tracker *dt)
+{
+    memset(dt, 0, sizeof(*dt));
+    pagemap_walk_init(&dt->walk);
+}
+
+static void dirty_batch(void *arg, const uint64_t *entries, size_t n)
+{
+    struct dirty_tracker *dt = arg;
+    size_t dirty = 0, present = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t e = entries[i];
+        present += (e & (PM_PRESENT | PM_SWAP)) != 0;
+        dirty += (e & (PM_PRESENT | PM_SWAP)) && (e & PM_SOFT_DIRTY);
+    }
+    dt->dirty += dirty;
+    dt->present += present;
+}
+
+// Returns the number of soft-dirty pages, or -1 if the process is gone.
+long dirty_scan(struct dirty_tracker *dt, int pid, bool required)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    dt->dirty = 0;
+    dt->present = 0;
+
+    if (!pagemap_walk(&dt->walk, pid, required, dirty_batch, dt))
+        return -1;
+
+    // New pages start out soft-dirty, so none at the first scan means the
+    // kernel does not track them.
+    if (!dt->checked && dt->present) {
+        if (!dt->dirty)
+            fprintf(stderr, "memprof: warning: no soft-dirty pages, is CONFIG_MEM_SOFT_DIRTY enabled?\n");
+        dt->checked = true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_DIRTY, timespec_diff(&t0, &t1));
+    return dt->dirty;
+}
+
+// Page access trace (-D), for what-if replay by whatif. Each memprof sample
+// walks the pagemap of the target once and appends an epoch with the pages
+// unmapped and mapped since the previous sample, found by comparing the
+// present pages with those of the previous walk, and the pages referenced
+// meanwhile. Referenced bits come from idle page tracking with -I, in which
+// case the walk replaces idle_scan() for the target, and from soft-dirty
+// bits otherwise, so without -I only written pages count. Pages are kept as
+// runs, so a footprint of large mappings costs a few bytes per epoch.
+struct trace_run {
+    uint64_t start, len;
+};
+
+struct trace_runs {
+    struct trace_run *run;
+    size_t n, max;
+};
+
+struct access_trace {
+    int fd;
+    long pagesize;
+    struct idle_tracker *idle;
+    struct pagemap_walk walk;
+    // Present pages of this walk and of the previous one
+    struct trace_runs present, last;
+    struct trace_runs list[EMUTRACE_LISTS];
+    size_t referenced;
+    bool checked;
+    // Epoch being encoded, record first
+    uint8_t *buf;
+    size_t len, size;
+    long epochs;
+    uint64_t bytes;
+};
+
+void trace_open(struct access_trace *tr, const char *fname, int rank,
+        struct idle_tracker *idle)
+{
+    memset(tr, 0, sizeof(*tr));
+    tr->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (tr->fd < 0) {
+        sprintf(tmp, "memprof: can't open trace '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    tr->pagesize = sysconf(_SC_PAGESIZE);
+    tr->idle = idle;
+    pagemap_walk_init(&tr->walk);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct emutrace_header h = {};
+    memcpy(h.magic, EMUTRACE_MAGIC, sizeof(h.magic));
+    h.version = EMUTRACE_VERSION;
+    h.page_size = tr->pagesize;
+    h.rank = rank;
+    h.source = idle ? EMUTRACE_IDLE : EMUTRACE_DIRTY;
+    h.start = now.tv_sec + 1e-9*now.tv_nsec - get_time();
+    PERR(write(tr->fd, &h, sizeof(h)) != sizeof(h), "memprof: write trace");
+    tr->bytes = sizeof(h);
+}
+
+static void trace_runs_add(struct trace_runs *r, uint64_t start, uint64_t len)
+{
+    if (r->n && r->run[r->n-1].start + r->run[r->n-1].len == start) {
+        r->run[r->n-1].len += len;
+        return;
+    }
+    if (r->n == r->max) {
+        r->max = r->max ? 2 * r->max : 1024;
+        r->run = realloc(r->run, r->max * sizeof(*r->run));
+        PERR(!r->run, "memprof: trace runs");
+    }
+    r->run[r->n++] = (struct trace_run){start, len};
+}
+
+// Pages of a that are not in b, both sorted
+static void trace_runs_diff(const struct trace_runs *a, const struct trace_runs *b,
+        struct trace_runs *out)
+{
+    size_t j = 0;
+
+    out->n = 0;
+    for (size_t i = 0; i < a->n; i++) {
+        uint64_t s = a->run[i].start, e = s + a->run[i].len;
+
+        while (j < b->n && b->run[j].start + b->run[j].len <= s)
+            j++;
+        for (size_t k = j; s < e; k++) {
+            if (k == b->n || b->run[k].start >= e) {
+                trace_runs_add(out, s, e - s);
+                break;
+            }
+            if (b->run[k].start > s)
+                trace_runs_add(out, s, b->run[k].start - s);
+            s = b->run[k].start + b->run[k].len;
+        }
+    }
+}
+
+static void trace_batch(void *arg, const uint64_t *entries, size_t n)
+{
+    struct access_trace *tr = arg;
+    uint64_t page = tr->walk.addr / tr->pagesize;
+
+    if (tr->idle)
+        idle_test_and_mark(tr->idle, entries, n);
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t e = entries[i];
+        if (!(e & PM_PRESENT))
+            continue;
+        trace_runs_add(&tr->present, page + i, 1);
+
+        bool referenced = tr->idle ? tr->idle->accessed[i] : (e & PM_SOFT_DIRTY) != 0;
+        if (referenced) {
+            trace_runs_add(&tr->list[EMUTRACE_REFERENCED], page + i, 1);
+            tr->referenced++;
+        }
+    }
+}
+
+static void trace_reserve(struct access_trace *tr, size_t n)
+{
+    if (tr->len + n <= tr->size)
+        return;
+    tr->size = 2 * tr->size + n + 4096;
+    tr->buf = realloc(tr->buf, tr->size);
+    PERR(!tr->buf, "memprof: trace buffer");
+}
+
+static void trace_varint(struct access_trace *tr, uint64_t v)
+{
+    trace_reserve(tr, 10);
+    while (v >= 0x80) {
+        tr->buf[tr->len++] = v | 0x80;
+        v >>= 7;
+    }
+    tr->buf[tr->len++] = v;
+}
+
+// Append an epoch for pid. Returns the number of referenced pages, or -1 if
+// the process is gone.
+long trace_scan(struct access_trace *tr, int pid, bool required)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    tr->present.n = 0;
+    tr->list[EMUTRACE_REFERENCED].n = 0;
+    tr->referenced = 0;
+    if (!pagemap_walk(&tr->walk, pid, required, trace_batch, tr))
+        return -1;
+
+    // Same check as dirty_scan()
+    if (!tr->idle && !tr->checked && tr->present.n) {
+        if (!tr->referenced)
+            fprintf(stderr, "memprof: warning: no soft-dirty pages, is CONFIG_MEM_SOFT_DIRTY enabled?\n");
+        tr->checked = true;
+    }
+
+    trace_runs_diff(&tr->last, &tr->present, &tr->list[EMUTRACE_UNMAPPED]);
+    trace_runs_diff(&tr->present, &tr->last, &tr->list[EMUTRACE_MAPPED]);
+
+    struct emutrace_epoch ep = {.time = get_time()};
+    tr->len = 0;
+    trace_reserve(tr, sizeof(ep));
+    tr->len = sizeof(ep);
+    for (int l = 0; l < EMUTRACE_LISTS; l++) {
+        const struct trace_runs *r = &tr->list[l];
+        uint64_t end = 0;
+        for (size_t i = 0; i < r->n; i++) {
+            trace_varint(tr, r->run[i].start - end);
+            trace_varint(tr, r->run[i].len - 1);
+            end = r->run[i].start + r->run[i].len;
+        }
+        ep.runs[l] = r->n;
+    }
+    ep.size = tr->len - sizeof(ep);
+    memcpy(tr->buf, &ep, sizeof(ep));
+    PERR(write(tr->fd, tr->buf, tr->len) != (ssize_t)tr->len, "memprof: write trace");
+    tr->epochs++;
+    tr->bytes += tr->len;
+
+    struct trace_runs t = tr->last;
+    tr->last = tr->present;
+    tr->present = t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_TRACE, timespec_diff(&t0, &t1));
+    return tr->referenced;
+}
+
+void trace_close(struct access_trace *tr)
+{
+    printf("memprof: trace epochs %ld sizeKB %llu\n", tr->epochs,
+            (unsigned long long)(tr->bytes + KB - 1) / KB);
+    close(tr->fd);
+    for (int l = 0; l < EMUTRACE_LISTS; l++)
+        free(tr->list[l].run);
+    free(tr->present.run);
+    free(tr->last.run);
+    free(tr->buf);
+}
+
+void memprof_print(int pid, const struct memprof_stats *st, const char *extra)
+{
+    float hot = 0;
+    if (st->rss)
+        hot = (float)st->ref / (float)st->rss;
+    double time = get_time();
+    if (pid) {
+        printf("memprof: pid %d ", pid);
+    } else {
+        printf("memprof: ");
+
+        struct emulog_record rec = {};
+        rec.flags = EMULOG_MEMPROF;
+        rec.rss_kb = st->rss;
+        rec.pss_kb = st->pss;
+        rec.ref_kb = st->ref;
+        rec.anon_kb = st->anon;
+        sample_log_write(&rec);
+    }
+    printf("rssKB %zu pssKB %zu refKB %zu hot %.4f time %.*f anonKB %zu%s%s%s\n",
+            st->rss, st->pss, st->ref, hot, time_digits, time, st->anon, extra,
+            pid ? "" : overhead_column(), pid ? "" : perf_column());
+}
+
+// Set of processes descending from the target, kept between samples so that
+// each refresh only reads the children lists of processes already known
+// (or cgroup.procs with the cgroup backend). emu is a child subreaper, so
+// orphaned descendants are reparented to it and stay in the tree.
+struct proc {
+    int pid;
+    bool seen;
+    struct numa_maps nm;
+};
+
+struct proc_tree {
+    int target;
+    struct cgroup *cg;
+    struct proc *procs;
+    int n, cap;
+    // Open addressing table of index + 1 in procs by pid, rebuilt at every
+    // refresh since dropping a process moves another one
+    int *index;
+    int index_size;
+    int *stack;
+    int stack_n, stack_cap;
+    char *buf;
+    size_t size;
+    // Fallback without CONFIG_PROC_CHILDREN: (pid, ppid) pairs from /proc
+    bool no_children_file;
+    int *ppids;
+    int ppids_n, ppids_cap;
+    bool page_sizes;
+};
+
+// Must be called before the target is started, the pid is filled in later.
+void proc_tree_init(struct proc_tree *t, struct cgroup *cg)
+{
+    memset(t, 0, sizeof(*t));
+    t->cg = cg;
+    PERR(prctl(PR_SET_CHILD_SUBREAPER, 1) < 0, "emu: set child subreaper");
+}
+
+static void proc_tree_push(struct proc_tree *t, int pid)
+{
+    if (t->stack_n == t->stack_cap) {
+        t->stack_cap = t->stack_cap ? 2*t->stack_cap : 64;
+        t->stack = realloc(t->stack, t->stack_cap * sizeof(int));
+        PERR(!t->stack, "emu: proc tree");
+    }
+    t->stack[t->stack_n++] = pid;
+}
+
+static void proc_tree_push_list(struct proc_tree *t, int parent, size_t len)
+{
+    char *p = t->buf;
+    char *end = t->buf + len;
+
+    while (p < end) {
+        char *q;
+        long pid = strtol(p, &q, 10);
+        if (q == p)
+            break;
+        p = q;
+
+        // Reap orphans that were reparented to us and have exited
+        if (parent == getpid() && pid != t->target &&
+                waitpid(pid, NULL, WNOHANG) > 0)
+            continue;
+
+        proc_tree_push(t, pid);
+    }
+}
+
+static void proc_tree_scan_proc(struct proc_tree *t)
+{
+    DIR *dir = opendir("/proc");
+    PERR(!dir, "emu: opendir /proc");
+
+    t->ppids_n = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!isdigit(de->d_name[0]))
+            continue;
+
+        char fname[sizeof("/proc//stat") + NAME_MAX];
+        snprintf(fname, sizeof(fname), "/proc/%s/stat", de->d_name);
+        int fd = open(fname, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ssize_t n = read(fd, tmp, sizeof(tmp) - 1);
+        close(fd);
+        if (n <= 0)
+            continue;
+        tmp[n] = '\0';
+
+        // The command name may contain spaces, ppid is the 2nd field after it
+        char *p = strrchr(tmp, ')');
+        int ppid;
+        if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+            continue;
+
+        if (t->ppids_n + 2 > t->ppids_cap) {
+            t->ppids_cap = t->ppids_cap ? 2*t->ppids_cap : 1024;
+            t->ppids = realloc(t->ppids, t->ppids_cap * sizeof(int));
+            PERR(!t->ppids, "emu: proc tree");
+        }
+        t->ppids[t->ppids_n++] = atoi(de->d_name);
+        t->ppids[t->ppids_n++] = ppid;
+    }
+    closedir(dir);
+}
+
+static void proc_tree_push_children(struct proc_tree *t, int pid)
+{
+    if (t->no_children_file) {
+        for (int i = 0; i < t->ppids_n; i += 2) {
+            if (t->ppids[i+1] != pid)
+                continue;
+            int child = t->ppids[i];
+            if (pid == getpid() && child != t->target &&
+                    waitpid(child, NULL, WNOHANG) > 0)
+                continue;
+            proc_tree_push(t, child);
+        }
+        return;
+    }
+
+    char fname[sizeof("/proc//task//children") + 11 + NAME_MAX];
+    snprintf(fname, sizeof(fname), "/proc/%d/task", pid);
+    DIR *dir = opendir(fname);
+    if (!dir)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (!isdigit(de->d_name[0]))
+            continue;
+
+        snprintf(fname, sizeof(fname), "/proc/%d/task/%s/children", pid, de->d_name);
+        int fd = open(fname, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT && pid == getpid()) {
+                fprintf(stderr, "emu: warning: no /proc/*/task/*/children, scanning /proc\n");
+                t->no_children_file = true;
+                closedir(dir);
+                proc_tree_scan_proc(t);
+                proc_tree_push_children(t, pid);
+                return;
+            }
+            continue;
+        }
+        size_t len = pread_all(fd, &t->buf, &t->size, fname);
+        close(fd);
+
+        proc_tree_push_list(t, pid, len);
+    }
+    closedir(dir);
+}
+
+static int *proc_tree_slot(struct proc_tree *t, int pid)
+{
+    unsigned h = (unsigned)pid * 2654435761u;
+    int *slot;
+
+    for (;; h++) {
+        slot = &t->index[h & (t->index_size - 1)];
+        if (!*slot || t->procs[*slot - 1].pid == pid)
+            return slot;
+    }
+}
+
+static void proc_tree_reindex(struct proc_tree *t)
+{
+    if (2 * (t->cap + 1) > t->index_size) {
+        while (2 * (t->cap + 1) > t->index_size)
+            t->index_size = t->index_size ? 2*t->index_size : 64;
+        free(t->index);
+        t->index = malloc(t->index_size * sizeof(int));
+        PERR(!t->index, "emu: proc tree");
+    }
+    memset(t->index, 0, t->index_size * sizeof(int));
+    for (int i = 0; i < t->n; i++)
+        *proc_tree_slot(t, t->procs[i].pid) = i + 1;
+}
+
+static struct proc *proc_tree_get(struct proc_tree *t, int pid)
+{
+    int *slot = proc_tree_slot(t, pid);
+    if (*slot)
+        return &t->procs[*slot - 1];
+
+    if (t->n == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 16;
+        t->procs = realloc(t->procs, t->cap * sizeof(struct proc));
+        PERR(!t->procs, "emu: proc tree");
+        proc_tree_reindex(t);
+        slot = proc_tree_slot(t, pid);
+    }
+    *slot = t->n + 1;
+    struct proc *p = &t->procs[t->n++];
+    p->pid = pid;
+    p->seen = false;
+    numa_maps_init(&p->nm, pid, t->page_sizes);
+    p->nm.file.optional = true;
+    p->nm.smaps.optional = true;
+    return p;
+}
+
+void proc_tree_refresh(struct proc_tree *t)
+{
+    for (int i = 0; i < t->n; i++)
+        t->procs[i].seen = false;
+    proc_tree_reindex(t);
+
+    t->stack_n = 0;
+    if (t->cg) {
+        char fname[PATH_MAX + 32];
+        snprintf(fname, sizeof(fname), "%s/cgroup.procs", t->cg->path);
+        int fd = open(fname, O_RDONLY | O_CLOEXEC);
+        PERR(fd < 0, "emu: open cgroup.procs");
+        size_t len = pread_all(fd, &t->buf, &t->size, fname);
+        close(fd);
+        proc_tree_push_list(t, -1, len);
+    } else {
+        if (t->no_children_file)
+            proc_tree_scan_proc(t);
+        proc_tree_push_children(t, getpid());
+    }
+
+    while (t->stack_n > 0) {
+        int pid = t->stack[--t->stack_n];
+        struct proc *p = proc_tree_get(t, pid);
+        if (p->seen)
+            continue;
+        p->seen = true;
+
+        if (!t->cg)
+            proc_tree_push_children(t, pid);
+    }
+
+    // Drop processes that have exited
+    for (int i = 0; i < t->n; ) {
+        if (t->procs[i].seen) {
+            i++;
+            continue;
+        }
+        numa_maps_close(&t->procs[i].nm);
+        t->procs[i] = t->procs[--t->n];
+    }
+}
+
+// Reap orphans that were reparented to emu and have exited. The target is
+// left for the main loop, so reaping stops at it.
+void proc_tree_reap(struct proc_tree *t)
+{
+    for (;;) {
+        siginfo_t si = {};
+        if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+                !si.si_pid || si.si_pid == t->target)
+            return;
+        waitpid(si.si_pid, NULL, WNOHANG);
+    }
+}
+
+void emu_show_tree_stats(struct proc_tree *t)
+{
+    long long node_bytes[2] = {}, by_node[NODES_MAX] = {};
+    struct page_sizes sizes = {};
+    double sample_time = 0;
+    int n = 0;
+
+    proc_tree_refresh(t);
+
+    for (int i = 0; i < t->n; i++) {
+        struct numa_maps *nm = &t->procs[i].nm;
+        if (!numa_maps_sample(nm))
+            continue;
+
+        emu_print_stats(nm->file.pid, nm->node_bytes, nm->by_node, nm->parse_time,
+                page_sizes_format(&nm->sizes, t->page_sizes));
+        for (int node = 0; node < NODES_MAX; node++)
+            by_node[node] += nm->by_node[node];
+        for (int node = 0; node < 2; node++) {
+            node_bytes[node] += nm->node_bytes[node];
+            sizes.base[node] += nm->sizes.base[node];
+            sizes.thp[node] += nm->sizes.thp[node];
+            sizes.hugetlb[node] += nm->sizes.hugetlb[node];
+        }
+        sample_time += nm->parse_time;
+        n++;
+    }
+
+    char extra[288];
+    snprintf(extra, sizeof(extra), " procs %d%s", n,
+            page_sizes_format(&sizes, t->page_sizes));
+    emu_print_stats(0, node_bytes, by_node, sample_time, extra);
+}
+
+// Hot/cold page tiering. Every interval the anonymous memory of the target
+// is scanned: each page gets an 8-bit access history (shifted right every
+// interval, top bit set if accessed), from idle page tracking if available
+// and soft-dirty bits otherwise. Remote pages are then promoted hottest
+// first into the free local capacity, demoting colder local pages to make
+// room, with both directions capped to a rate. Pages are moved in batches
+// with move_pages() to the local or far node with the most free memory, and
+// the node cache of a page holds its side (0 local, 1 far), not its node.
+#define TIER_BATCH 4096
+#define TIER_HEADROOM (128LL*MB)
+#define TIER_NODE_UNKNOWN 0xff
+#define TIER_NODE_QUERY 0xfe
+
+struct tier_vma {
+    unsigned long start, end;
+    uint8_t *heat;
+    uint8_t *node;
+};
+
+struct tier {
+    int pid;
+    long pagesize;
+    double promote_rate, demote_rate;
+    struct idle_tracker *idle;
+    struct pagemap_walk walk;
+    struct tier_vma *vmas, *next;
+    int n, nnext, cap, old;
+    long hist[2][256];
+    void *pages[TIER_BATCH];
+    int nodes[TIER_BATCH];
+    int status[TIER_BATCH];
+    uint8_t *slots[TIER_BATCH];
+    int nbatch;
+    double last_time;
+    long moved;
+    long long total_promoted, total_demoted;
+    double total_time;
+};
+
+void tier_init(struct tier *t, double promote_rate, double demote_rate,
+        struct idle_tracker *idle)
+{
+    memset(t, 0, sizeof(*t));
+    t->pagesize = sysconf(_SC_PAGESIZE);
+    t->promote_rate = promote_rate;
+    t->demote_rate = demote_rate;
+    t->idle = idle;
+    pagemap_walk_init(&t->walk);
+
+    if (!idle)
+        fprintf(stderr, "emu: warning: tier: no idle page tracking, using soft-dirty bits (writes only)\n");
+}
+
+static bool tier_vma_eligible(const char *path)
+{
+    return !*path || strcmp(path, "[heap]") == 0 || strcmp(path, "[stack]") == 0;
+}
+
+// Find the entry for the mapping being scanned, reusing the history of the
+// previous scan if the mapping still starts at the same address.
+static struct tier_vma *tier_vma_get(struct tier *t, unsigned long start, unsigned long end)
+{
+    if (t->nnext && t->next[t->nnext-1].start == start)
+        return &t->next[t->nnext-1];
+
+    if (t->nnext == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 64;
+        t->vmas = realloc(t->vmas, t->cap * sizeof(struct tier_vma));
+        t->next = realloc(t->next, t->cap * sizeof(struct tier_vma));
+        PERR(!t->vmas || !t->next, "emu: tier");
+    }
+    struct tier_vma *v = &t->next[t->nnext++];
+    size_t npages = (end - start) / t->pagesize;
+    size_t oldpages = 0;
+
+    memset(v, 0, sizeof(*v));
+    while (t->old < t->n && t->vmas[t->old].start < start)
+        t->old++;
+    if (t->old < t->n && t->vmas[t->old].start == start) {
+        struct tier_vma *o = &t->vmas[t->old];
+        v->heat = o->heat;
+        v->node = o->node;
+        oldpages = (o->end - o->start) / t->pagesize;
+        o->heat = o->node = NULL;
+    }
+    v->start = start;
+    v->end = end;
+
+    if (npages != oldpages) {
+        v->heat = realloc(v->heat, npages);
+        v->node = realloc(v->node, npages);
+        PERR(npages && (!v->heat || !v->node), "emu: tier");
+        if (npages > oldpages) {
+            memset(v->heat + oldpages, 0, npages - oldpages);
+            memset(v->node + oldpages, TIER_NODE_UNKNOWN, npages - oldpages);
+        }
+    }
+    return v;
+}
+
+static void tier_batch(void *arg, const uint64_t *entries, size_t n)
+{
+    struct tier *t = arg;
+    struct pagemap_walk *w = &t->walk;
+
+    if (!tier_vma_eligible(w->vma_path))
+        return;
+
+    struct tier_vma *v = tier_vma_get(t, w->vma_start, w->vma_end);
+    size_t first = (w->addr - v->start) / t->pagesize;
+
+    if (t->idle)
+        idle_test_and_mark(t->idle, entries, n);
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t e = entries[i];
+        size_t idx = first + i;
+
+        if (!(e & PM_PRESENT)) {
+            v->heat[idx] = 0;
+            v->node[idx] = TIER_NODE_UNKNOWN;
+            continue;
+        }
+
+        bool accessed = t->idle ? t->idle->accessed[i] : (e & PM_SOFT_DIRTY) != 0;
+
+        v->heat[idx] = (v->heat[idx] >> 1) | (accessed ? 0x80 : 0);
+        if (v->node[idx] == TIER_NODE_UNKNOWN)
+            v->node[idx] = TIER_NODE_QUERY;
+    }
+}
+
+// Query (nodes == -1) or move a batch of pages and update the node cache
+static long tier_flush(struct tier *t, bool query)
+{
+    long moved = 0;
+
+    if (!t->nbatch)
+        return 0;
+
+    long ret = move_pages(t->pid, t->nbatch, t->pages, query ? NULL : t->nodes,
+            t->status, query ? 0 : MPOL_MF_MOVE);
+    if (ret < 0 && errno != ESRCH && errno != ENOENT)
+        perror("emu: tier: move_pages");
+
+    for (int i = 0; i < t->nbatch; i++) {
+        int st = ret < 0 ? -1 : t->status[i];
+        int side = topology_side(st);
+        if (side >= 0)
+            *t->slots[i] = side;
+        else if (query)
+            *t->slots[i] = TIER_NODE_UNKNOWN;
+
+        if (!query && st == t->nodes[i])
+            moved++;
+    }
+    t->nbatch = 0;
+
+    return moved;
+}
+
+static void tier_add(struct tier *t, struct tier_vma *v, size_t idx, int node, bool query)
+{
+    t->pages[t->nbatch] = (void *)(v->start + idx * t->pagesize);
+    t->nodes[t->nbatch] = node;
+    t->slots[t->nbatch] = &v->node[idx];
+    if (++t->nbatch == TIER_BATCH)
+        t->moved += tier_flush(t, query);
+}
+
+// Move up to quota pages at heat level lvl and all pages with heat in
+// (lo, hi) from side "from" to node "to".
+static long tier_move(struct tier *t, int from, int to, int lo, int hi, int lvl, long quota)
+{
+    t->moved = 0;
+
+    for (int i = 0; i < t->n; i++) {
+        struct tier_vma *v = &t->vmas[i];
+        size_t npages = (v->end - v->start) / t->pagesize;
+
+        for (size_t j = 0; j < npages; j++) {
+            if (v->node[j] != from)
+                continue;
+
+            int h = v->heat[j];
+            if (h == lvl && quota > 0)
+                quota--;
+            else if (h <= lo || h >= hi)
+                continue;
+
+            tier_add(t, v, j, to, false);
+        }
+    }
+    t->moved += tier_flush(t, false);
+
+    return t->moved;
+}
+
+void tier_step(struct tier *t)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    double now = get_time();
+    double elapsed = t->last_time ? now - t->last_time : 0;
+    t->last_time = now;
+
+    // Scan access bits, merging with the previous history
+    t->nnext = 0;
+    t->old = 0;
+    bool alive = pagemap_walk(&t->walk, t->pid, false, tier_batch, t);
+    if (!t->idle && alive)
+        memprof_clear_refs(t->pid, 4, false);
+
+    for (int i = 0; i < t->n; i++) {
+        free(t->vmas[i].heat);
+        free(t->vmas[i].node);
+    }
+    struct tier_vma *prev = t->vmas;
+    t->vmas = t->next;
+    t->next = prev;
+    t->n = t->nnext;
+
+    if (!alive)
+        return;
+
+    // Look up the node of newly present pages and build the histograms
+    memset(t->hist, 0, sizeof(t->hist));
+    for (int i = 0; i < t->n; i++) {
+        struct tier_vma *v = &t->vmas[i];
+        size_t npages = (v->end - v->start) / t->pagesize;
+
+        for (size_t j = 0; j < npages; j++) {
+            if (v->node[j] == TIER_NODE_QUERY)
+                tier_add(t, v, j, -1, true);
+        }
+    }
+    tier_flush(t, true);
+
+    for (int i = 0; i < t->n; i++) {
+        struct tier_vma *v = &t->vmas[i];
+        size_t npages = (v->end - v->start) / t->pagesize;
+
+        for (size_t j = 0; j < npages; j++) {
+            if (v->node[j] < 2)
+                t->hist[v->node[j]][v->heat[j]]++;
+        }
+    }
+
+    // Pair the hottest remote pages with free local capacity first, then
+    // with the coldest local pages, as long as they are colder.
+    int local = topology.nodes[0], far = topology.nodes[topology.nlocal];
+    long long avail = 0;
+    topology_free(0, &local);
+    topology_free(1, &far);
+    numa_node_size64(local, &avail);
+    long room = avail > TIER_HEADROOM ? (avail - TIER_HEADROOM) / t->pagesize : 0;
+    long promote_max = t->promote_rate * elapsed / t->pagesize;
+    long demote_max = t->demote_rate * elapsed / t->pagesize;
+
+    int hr = 255, hl = 0;
+    long cr = t->hist[1][hr], cl = t->hist[0][hl];
+    long promote = 0, demote = 0;
+
+    while (promote < promote_max) {
+        while (hr > 0 && cr == 0)
+            cr = t->hist[1][--hr];
+        if (hr == 0)
+            break;
+
+        if (promote >= room + demote) {
+            if (demote >= demote_max)
+                break;
+            while (hl < hr && cl == 0)
+                cl = t->hist[0][++hl];
+            if (hl >= hr)
+                break;
+            demote++;
+            cl--;
+        }
+        promote++;
+        cr--;
+    }
+
+    long demoted = 0, promoted = 0;
+    if (demote)
+        demoted = tier_move(t, 0, far, -1, hl, hl, t->hist[0][hl] - cl);
+    if (promote)
+        promoted = tier_move(t, 1, local, hr, 256, hr, t->hist[1][hr] - cr);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double time = timespec_diff(&t0, &t1);
+
+    t->total_promoted += promoted;
+    t->total_demoted += demoted;
+    t->total_time += time;
+    overhead_add(OVERHEAD_TIER, time);
+
+    printf("emu: tier promoted %ld demoted %ld pagesps %.0f tierms %.3f time %.*f\n",
+            promoted, demoted, elapsed > 0 ? (promoted + demoted) / elapsed : 0,
+            1e3 * time, time_digits, now);
+}
+
+void tier_summary(struct tier *t)
+{
+    printf("emu: tier total promotedGB %.2f demotedGB %.2f tiers %.2f\n",
+            t->total_promoted * t->pagesize / (float)GB,
+            t->total_demoted * t->pagesize / (float)GB,
+            t->total_time);
+}
+
+// Allocation sites (-A). libemualloc.so is preloaded into the target and
+// records its large allocations and their call sites in shared memory
+// (emualloc.h). Every interval the records are applied to a table of live
+// allocations, ALLOC_SAMPLE_PAGES pages of them in total are looked up with
+// move_pages() in batches, and the call sites with the most remote bytes
+// are printed. Return addresses are printed as object+offset from the maps
+// of the target, for addr2line.
+#define ALLOC_MIN_SIZE (128*KB)
+#define ALLOC_SAMPLE_PAGES 4096
+#define ALLOC_BATCH 4096
+
+struct alloc_live {
+    uint64_t addr, size;
+    uint32_t site;
+};
+
+struct alloc_site_stats {
+    long allocs;
+    long long live, local, remote;
+};
+
+struct alloc_sites {
+    int pid;
+    int top;
+    long pagesize;
+    int fd;
+    char preload[PATH_MAX + 16];
+    struct emualloc_shm *shm;
+    // Open addressing by address, cap is a power of two
+    struct alloc_live *live;
+    size_t nlive, cap;
+    struct emualloc_record *records;
+    size_t nrecords, records_cap;
+    // The last one is for allocations without a site
+    struct alloc_site_stats stats[EMUALLOC_SITES + 1];
+    int order[EMUALLOC_SITES + 1];
+    // Sampled pages move by one every interval
+    uint64_t phase;
+    void *pages[ALLOC_BATCH];
+    int status[ALLOC_BATCH];
+    int owner[ALLOC_BATCH];
+    long weight[ALLOC_BATCH];
+    int nbatch;
+};
+
+// libemualloc.so is looked up next to the emu binary. With top 0 it only
+// places allocations (-X), nothing is recorded.
+void alloc_sites_init(struct alloc_sites *as, int top)
+{
+    memset(as, 0, sizeof(*as));
+    as->top = top;
+    as->pagesize = sysconf(_SC_PAGESIZE);
+
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    PERR(len < 0, "emu: readlink /proc/self/exe");
+    exe[len] = '\0';
+    char *slash = strrchr(exe, '/');
+    if (slash)
+        *slash = '\0';
+    snprintf(as->preload, sizeof(as->preload), "%s/libemualloc.so", exe);
+    if (access(as->preload, R_OK) < 0) {
+        fprintf(stderr, "error: %s not found, build it with make\n", as->preload);
+        exit(EXIT_FAILURE);
+    }
+
+    as->fd = memfd_create("emualloc", 0);
+    PERR(as->fd < 0, "emu: create allocation log");
+    PERR(ftruncate(as->fd, sizeof(*as->shm)) < 0, "emu: size allocation log");
+    as->shm = mmap(NULL, sizeof(*as->shm), PROT_READ | PROT_WRITE, MAP_SHARED, as->fd, 0);
+    PERR(as->shm == MAP_FAILED, "emu: map allocation log");
+    as->shm->magic = EMUALLOC_MAGIC;
+    as->shm->record_size = top ? ALLOC_MIN_SIZE : 0;
+
+    as->cap = 1024;
+    as->live = calloc(as->cap, sizeof(*as->live));
+    PERR(!as->live, "emu: allocate live allocations");
+
+    sprintf(tmp, "%d", as->fd);
+    PERR(setenv(EMUALLOC_ENV, tmp, 1) < 0, "emu: set " EMUALLOC_ENV);
+}
+
+// Called in the child before exec: only the target itself records
+void alloc_sites_preload(struct alloc_sites *as)
+{
+    as->shm->pid = getpid();
+
+    const char *old = getenv("LD_PRELOAD");
+    if (old && *old) {
+        char *val;
+        PERR(asprintf(&val, "%s:%s", as->preload, old) < 0, "emu: LD_PRELOAD");
+        PERR(setenv("LD_PRELOAD", val, 1) < 0, "emu: set LD_PRELOAD");
+    } else {
+        PERR(setenv("LD_PRELOAD", as->preload, 1) < 0, "emu: set LD_PRELOAD");
+    }
+}
+
+static size_t alloc_slot(struct alloc_sites *as, uint64_t addr)
+{
+    return ((addr >> 12) * 0x9e3779b97f4a7c15ULL) & (as->cap - 1);
+}
+
+static void alloc_insert(struct alloc_sites *as, uint64_t addr, uint64_t size, uint32_t site)
+{
+    if (2 * (as->nlive + 1) > as->cap) {
+        struct alloc_live *old = as->live;
+        size_t oldcap = as->cap;
+
+        as->cap *= 2;
+        as->live = calloc(as->cap, sizeof(*as->live));
+        PERR(!as->live, "emu: allocate live allocations");
+        as->nlive = 0;
+        for (size_t i = 0; i < oldcap; i++)
+            if (old[i].size)
+                alloc_insert(as, old[i].addr, old[i].size, old[i].site);
+        free(old);
+    }
+
+    size_t i = alloc_slot(as, addr);
+    while (as->live[i].size && as->live[i].addr != addr)
+        i = (i + 1) & (as->cap - 1);
+    if (!as->live[i].size)
+        as->nlive++;
+    as->live[i] = (struct alloc_live){addr, size, site};
+}
+
+// Backward shift deletion, so lookups need no tombstones
+static void alloc_remove(struct alloc_sites *as, uint64_t addr)
+{
+    size_t mask = as->cap - 1;
+    size_t i = alloc_slot(as, addr);
+    while (as->live[i].size && as->live[i].addr != addr)
+        i = (i + 1) & mask;
+    if (!as->live[i].size)
+        return;
+
+    as->nlive--;
+    for (size_t j = (i + 1) & mask; as->live[j].size; j = (j + 1) & mask) {
+        size_t home = alloc_slot(as, as->live[j].addr);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            as->live[i] = as->live[j];
+            i = j;
+        }
+    }
+    as->live[i].size = 0;
+}
+
+// The parts of allocations left outside [addr, addr + len) stay live. The
+// table is keyed by start address, so this scans it, munmap is rare next to
+// malloc and free.
+static void alloc_unmap(struct alloc_sites *as, uint64_t addr, uint64_t len)
+{
+    uint64_t end = addr + len;
+    for (size_t i = 0; i < as->cap; i++) {
+        struct alloc_live a = as->live[i];
+        if (!a.size || a.addr >= end || a.addr + a.size <= addr)
+            continue;
+
+        alloc_remove(as, a.addr);
+        if (a.addr < addr)
+            alloc_insert(as, a.addr, addr - a.addr, a.site);
+        if (a.addr + a.size > end)
+            alloc_insert(as, end, a.addr + a.size - end, a.site);
+        // Removal and insertion move entries around
+        i = -1;
+    }
+}
+
+static int alloc_record_cmp(const void *a, const void *b)
+{
+    const struct emualloc_record *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Take the records of all threads and apply them in the order they were made
+static void alloc_drain(struct alloc_sites *as)
+{
+    as->nrecords = 0;
+    uint32_t nthreads = __atomic_load_n(&as->shm->nthreads, __ATOMIC_RELAXED);
+    if (nthreads > EMUALLOC_THREADS)
+        nthreads = EMUALLOC_THREADS;
+
+    for (uint32_t t = 0; t < nthreads; t++) {
+        struct emualloc_thread *th = &as->shm->thread[t];
+        uint64_t head = __atomic_load_n(&th->head, __ATOMIC_ACQUIRE);
+
+        for (uint64_t i = th->tail; i < head; i++) {
+            if (as->nrecords == as->records_cap) {
+                as->records_cap = as->records_cap ? 2 * as->records_cap : EMUALLOC_RECORDS;
+                as->records = realloc(as->records, as->records_cap * sizeof(*as->records));
+                PERR(!as->records, "emu: allocate allocation records");
+            }
+            as->records[as->nrecords++] = th->record[i % EMUALLOC_RECORDS];
+        }
+        __atomic_store_n(&th->tail, head, __ATOMIC_RELEASE);
+    }
+
+    qsort(as->records, as->nrecords, sizeof(*as->records), alloc_record_cmp);
+    for (size_t i = 0; i < as->nrecords; i++) {
+        struct emualloc_record *r = &as->records[i];
+        if (r->flags & EMUALLOC_UNMAP)
+            alloc_unmap(as, r->addr, r->size);
+        else if (r->size)
+            alloc_insert(as, r->addr, r->size, r->site);
+        else
+            alloc_remove(as, r->addr);
+    }
+}
+
+static void alloc_flush(struct alloc_sites *as)
+{
+    if (!as->nbatch)
+        return;
+
+    long ret = move_pages(as->pid, as->nbatch, as->pages, NULL, as->status, 0);
+    if (ret < 0 && errno != ESRCH && errno != ENOENT)
+        perror("emu: allocsite: move_pages");
+
+    for (int i = 0; ret >= 0 && i < as->nbatch; i++) {
+        struct alloc_site_stats *s = &as->stats[as->owner[i]];
+        int side = topology_side(as->status[i]);
+        if (side == 0)
+            s->local += as->weight[i];
+        else if (side == 1)
+            s->remote += as->weight[i];
+    }
+    as->nbatch = 0;
+}
+
+// Object and offset of a return address, from the maps of the target
+static void alloc_format_pc(char *buf, size_t size, uint64_t pc, FILE *maps)
+{
+    snprintf(buf, size, "0x%lx", pc);
+    if (!maps)
+        return;
+
+    rewind(maps);
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, end, off;
+        int path = 0;
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n", &start, &end, &off, &path) < 3 || !path)
+            continue;
+        if (pc < start || pc >= end)
+            continue;
+
+        char *name = line + path;
+        name[strcspn(name, "\n")] = '\0';
+        char *base = strrchr(name, '/');
+        if (*name)
+            snprintf(buf, size, "%s+0x%lx", base ? base + 1 : name, pc - start + off);
+        return;
+    }
+}
+
+void alloc_sites_step(struct alloc_sites *as)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    alloc_drain(as);
+    memset(as->stats, 0, sizeof(as->stats));
+
+    // Every step-th page of all allocations one after the other, so each
+    // gets samples in proportion to its size. One smaller than step may get
+    // none in an interval, the phase moves on so that it gets its turn.
+    uint64_t total = 0;
+    for (size_t i = 0; i < as->cap; i++) {
+        struct alloc_live *a = &as->live[i];
+        if (a->size)
+            total += (a->addr + a->size - (a->addr & ~(uint64_t)(as->pagesize - 1)) +
+                    as->pagesize - 1) / as->pagesize;
+    }
+    uint64_t step = total > ALLOC_SAMPLE_PAGES ? (total + ALLOC_SAMPLE_PAGES - 1) / ALLOC_SAMPLE_PAGES : 1;
+    uint64_t phase = as->phase++ % step;
+    uint64_t start = 0;
+
+    for (size_t i = 0; i < as->cap; i++) {
+        struct alloc_live *a = &as->live[i];
+        if (!a->size)
+            continue;
+
+        int site = a->site < EMUALLOC_SITES ? (int)a->site : EMUALLOC_SITES;
+        as->stats[site].allocs++;
+        as->stats[site].live += a->size;
+
+        uint64_t first = a->addr & ~(uint64_t)(as->pagesize - 1);
+        uint64_t npages = (a->addr + a->size - first + as->pagesize - 1) / as->pagesize;
+        uint64_t p = (phase + step - start % step) % step;
+        start += npages;
+        if (p >= npages)
+            continue;
+
+        // The samples of an allocation share its pages
+        uint64_t n = (npages - p + step - 1) / step;
+        for (uint64_t k = 0; p < npages; p += step, k++) {
+            as->pages[as->nbatch] = (void *)(first + p * as->pagesize);
+            as->owner[as->nbatch] = site;
+            as->weight[as->nbatch] = ((k + 1) * npages / n - k * npages / n) * as->pagesize;
+            if (++as->nbatch == ALLOC_BATCH)
+                alloc_flush(as);
+        }
+    }
+    alloc_flush(as);
+
+    // Top sites by remote bytes
+    int m = 0;
+    for (int i = 0; i <= EMUALLOC_SITES; i++) {
+        long long remote = as->stats[i].remote;
+        if (!as->stats[i].allocs ||
+                (m == as->top && remote <= as->stats[as->order[m-1]].remote))
+            continue;
+
+        int j = m < as->top ? m++ : m - 1;
+        while (j > 0 && as->stats[as->order[j-1]].remote < remote) {
+            as->order[j] = as->order[j-1];
+            j--;
+        }
+        as->order[j] = i;
+    }
+
+    snprintf(tmp, sizeof(tmp), "/proc/%d/maps", as->pid);
+    FILE *maps = m ? fopen(tmp, "r") : NULL;
+    double time = get_time();
+
+    for (int i = 0; i < m; i++) {
+        int site = as->order[i];
+        struct alloc_site_stats *s = &as->stats[site];
+        char stack[EMUALLOC_DEPTH * 80] = "unknown";
+
+        if (site < EMUALLOC_SITES) {
+            struct emualloc_site *es = &as->shm->site[site];
+            uint32_t depth = __atomic_load_n(&es->depth, __ATOMIC_ACQUIRE);
+            size_t len = 0;
+            for (uint32_t d = 0; d < depth && d < EMUALLOC_DEPTH; d++) {
+                char pc[PATH_MAX];
+                alloc_format_pc(pc, sizeof(pc), es->pc[d], maps);
+                len += snprintf(stack + len, sizeof(stack) - len, "%s%s", d ? "," : "", pc);
+                if (len >= sizeof(stack))
+                    break;
+            }
+        }
+
+        printf("emu: allocsite %d remoteMB %.1f localMB %.1f liveMB %.1f allocs %ld time %.*f stack %s\n",
+                i, (double)s->remote / MB, (double)s->local / MB, (double)s->live / MB,
+                s->allocs, time_digits, time, stack);
+    }
+    if (maps)
+        fclose(maps);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    overhead_add(OVERHEAD_ALLOC, timespec_diff(&t0, &t1));
+}
+
+void alloc_sites_destroy(struct alloc_sites *as)
+{
+    uint64_t dropped = __atomic_load_n(&as->shm->dropped, __ATOMIC_RELAXED);
+    if (dropped)
+        printf("emu: allocsite dropped %lu\n", dropped);
+
+    munmap(as->shm, sizeof(*as->shm));
+    close(as->fd);
+    free(as->live);
+    free(as->records);
+}
+
+// Per-region breakdown from the full /proc/<pid>/smaps. Contiguous mappings
+// of the same file (or anonymous memory) are folded into one region, keyed by
+// its start address and a hash of the file name. smaps lists mappings in
+// address order, so the previous region table is merged with the new one in
+// a single pass, carrying per-region state over without lookups.
+#define REGION_NAME 96
+
+struct region {
+    unsigned long start, end;
+    uint64_t key;
+    char name[REGION_NAME];
+    size_t rss, pss, ref, anon, swap_pss;
+    size_t peak_rss;
+};
+
+struct smaps_regions {
+    struct procfile file;
+    struct region *regions;
+    struct region *next;
+    int n, cap;
+    int top;
+    int *order;
+    double parse_time;
+};
+
+void regions_init(struct smaps_regions *sr, int top)
+{
+    memset(sr, 0, sizeof(*sr));
+    procfile_init(&sr->file, 0, "smaps");
+    sr->top = top;
+    sr->order = malloc(top * sizeof(int));
+    PERR(!sr->order, "memprof: regions");
+}
+
+static uint64_t hash_str(const char *s, size_t n)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t smaps_field(const char *line, const char *name)
+{
+    size_t n = strlen(name);
+    if (strncmp(line, name, n) != 0)
+        return (size_t)-1;
+    return strtoul(line + n, NULL, 10);
+}
+
+// Parse smaps into sr->regions, also summing the totals into st.
+static bool regions_parse(struct smaps_regions *sr, int pid, bool required,
+        struct memprof_stats *st)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (sr->file.pid != pid) {
+        procfile_close(&sr->file);
+        procfile_init(&sr->file, pid, "smaps");
+        sr->n = 0;
+    }
+    sr->file.optional = !required;
+    if (!procfile_read(&sr->file))
+        return false;
+
+    memset(st, 0, sizeof(*st));
+
+    int old = 0, n = 0;
+    struct region *cur = NULL;
+
+    for (char *line = sr->file.buf; *line; ) {
+        char *eol = strchr(line, '\n');
+        if (eol)
+            *eol = '\0';
+
+        // Mapping headers start with the address range, fields with "Name:"
+        char *sp = strchr(line, ' ');
+        if (sp && sp[-1] != ':') {
+            unsigned long start = 0, end = 0;
+            int pathoff = 0;
+            sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &pathoff);
+            const char *path = pathoff ? line + pathoff : "";
+            uint64_t key = hash_str(path, strlen(path));
+
+            if (!cur || cur->end != start || cur->key != key) {
+                if (n == sr->cap) {
+                    sr->cap = sr->cap ? 2*sr->cap : 256;
+                    sr->regions = realloc(sr->regions, sr->cap * sizeof(struct region));
+                    sr->next = realloc(sr->next, sr->cap * sizeof(struct region));
+                    PERR(!sr->regions || !sr->next, "memprof: regions");
+                }
+                cur = &sr->next[n++];
+                memset(cur, 0, sizeof(*cur));
+                cur->start = start;
+                cur->key = key;
+                snprintf(cur->name, sizeof(cur->name), "%s", *path ? path : "[anon]");
+
+                while (old < sr->n && sr->regions[old].start < start)
+                    old++;
+                if (old < sr->n && sr->regions[old].start == start &&
+                        sr->regions[old].key == key)
+                    cur->peak_rss = sr->regions[old].peak_rss;
+            }
+            cur->end = end;
+        } else if (cur) {
+            size_t v;
+            if ((v = smaps_field(line, "Rss:")) != (size_t)-1)
+                cur->rss += v;
+            else if ((v = smaps_field(line, "Pss:")) != (size_t)-1)
+                cur->pss += v;
+            else if ((v = smaps_field(line, "Referenced:")) != (size_t)-1)
+                cur->ref += v;
+            else if ((v = smaps_field(line, "Anonymous:")) != (size_t)-1)
+                cur->anon += v;
+            else if ((v = smaps_field(line, "SwapPss:")) != (size_t)-1)
+                cur->swap_pss += v;
+        }
+
+        if (!eol)
+            break;
+        line = eol + 1;
+    }
+
+    struct region *prev = sr->regions;
+    sr->regions = sr->next;
+    sr->next = prev;
+    sr->n = n;
+
+    for (int i = 0; i < n; i++) {
+        struct region *r = &sr->regions[i];
+        if (r->rss > r->peak_rss)
+            r->peak_rss = r->rss;
+        st->rss += r->rss;
+        st->pss += r->pss;
+        st->ref += r->ref;
+        st->anon += r->anon;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sr->parse_time = timespec_diff(&t0, &t1);
+    overhead_add(OVERHEAD_SMAPS, sr->parse_time);
+    return true;
+}
+
+// Print the top regions by RSS
+void regions_print(struct smaps_regions *sr, double time)
+{
+    int m = 0;
+
+    for (int i = 0; i < sr->n; i++) {
+        size_t rss = sr->regions[i].rss;
+        if (!rss || (m == sr->top && rss <= sr->regions[sr->order[m-1]].rss))
+            continue;
+
+        int j = m < sr->top ? m++ : m - 1;
+        while (j > 0 && sr->regions[sr->order[j-1]].rss < rss) {
+            sr->order[j] = sr->order[j-1];
+            j--;
+        }
+        sr->order[j] = i;
+    }
+
+    for (int i = 0; i < m; i++) {
+        struct region *r = &sr->regions[sr->order[i]];
+        float hot = (float)r->ref / (float)r->rss;
+        printf("memprof: region %d start %lx sizeKB %lu rssKB %zu refKB %zu hot %.4f"
+                " anonKB %zu swappssKB %zu peakrssKB %zu time %.*f name %s\n",
+                i, r->start, (r->end - r->start) / KB, r->rss, r->ref, hot,
+                r->anon, r->swap_pss, r->peak_rss, time_digits, time, r->name);
+    }
+}
+
+// Local memory reservation. The whole size of each local node is mapped up
+// front, bound to that node, and its reservation is the locked prefix of the
+// mapping. Growing it faults the pages in with one worker thread per CPU of
+// the node, each locking its own chunks, so the zeroing of pages is spread
+// over the node. Shrinking it releases the pages at the end. Transparent
+// huge pages are requested to cut the number of faults, or with -H explicit
+// huge pages are added to the hugetlb pool of the node as needed for the
+// duration of the run. The free local memory is split evenly between the
+// local nodes.
+#define THP_SIZE (2*MB)
+#define RESERVE_CHUNK (256*MB)
+
+enum reserve_mode {
+    RESERVE_4K,
+    RESERVE_THP,
+    RESERVE_HUGETLB,
+};
+
+static const char *reserve_mode_names[] = {"4k", "thp", "hugetlb"};
+
+struct reserve_node {
+    int node;
+    char *map;
+    size_t map_size;
+    char *ptr;
+    size_t max_size;
+    size_t size;
+    long hugetlb_added;
+    struct bitmask *cpus;
+    int nworkers;
+};
+
+struct reservation {
+    struct reserve_node node[NODES_MAX];
+    int n;
+    // Totals over the nodes
+    size_t size;
+    int nworkers;
+    size_t align;
+    enum reserve_mode mode;
+    long hugetlb_kb;
+    double time;
+};
+
+struct reserve_worker {
+    pthread_t thread;
+    struct reserve_node *rn;
+    // Chunks are handed out from a shared counter
+    size_t *next;
+    size_t end;
+    int err;
+};
+
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *reserve_worker_main(void *arg)
+{
+    struct reserve_worker *w = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&reserve_lock);
+        size_t off = *w->next;
+        *w->next += RESERVE_CHUNK;
+        pthread_mutex_unlock(&reserve_lock);
+
+        if (off >= w->end)
+            break;
+
+        size_t len = w->end - off < RESERVE_CHUNK ? w->end - off : RESERVE_CHUNK;
+
+        // Fault and prevent swapping
+        if (mlock(w->rn->ptr + off, len) < 0) {
+            w->err = errno;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static long hugetlb_pool(int node, long kb, const char *file, long set)
+{
+    char fname[128];
+    snprintf(fname, sizeof(fname),
+            "/sys/devices/system/node/node%d/hugepages/hugepages-%ldkB/%s", node, kb, file);
+
+    FILE *fp = fopen(fname, set >= 0 ? "w" : "r");
+    if (!fp)
+        return -1;
+
+    long n = set;
+    if (set >= 0)
+        fprintf(fp, "%ld\n", set);
+    else if (fscanf(fp, "%ld", &n) != 1)
+        n = -1;
+    if (fclose(fp))
+        return -1;
+    return n;
+}
+
+// Grow the pool of node by up to size bytes of huge pages, returns the
+// number of pages added.
+static long hugetlb_grow(int node, long kb, size_t size)
+{
+    long nr = hugetlb_pool(node, kb, "nr_hugepages", -1);
+    if (nr < 0)
+        return 0;
+
+    long want = size / (kb * KB);
+    hugetlb_pool(node, kb, "nr_hugepages", nr + want);
+
+    long added = hugetlb_pool(node, kb, "nr_hugepages", -1) - nr;
+    return added > 0 ? added : 0;
+}
+
+static void hugetlb_shrink(int node, long kb, long n)
+{
+    long nr = hugetlb_pool(node, kb, "nr_hugepages", -1);
+    if (nr >= 0)
+        hugetlb_pool(node, kb, "nr_hugepages", nr > n ? nr - n : 0);
+}
+
+// MADV_HUGEPAGE succeeds even when THP is disabled system-wide
+static bool thp_enabled(void)
+{
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!fp)
+        return false;
+    bool enabled = fgets(tmp, sizeof(tmp), fp) && !strstr(tmp, "[never]");
+    fclose(fp);
+    return enabled;
+}
+
+static void reserve_map(struct reservation *r, struct reserve_node *rn, char *addr, size_t len)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (addr)
+        flags |= MAP_FIXED;
+    if (r->mode == RESERVE_HUGETLB)
+        flags |= MAP_HUGETLB;
+
+    char *p = mmap(addr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    PERR(p == MAP_FAILED, "emu: mmap reservation");
+
+    if (!addr) {
+        rn->map = p;
+        rn->map_size = len;
+        rn->ptr = (char *)(((uintptr_t)p + r->align - 1) & ~(uintptr_t)(r->align - 1));
+        addr = rn->ptr;
+        len = rn->max_size;
+
+        // Fails for all nodes alike, so the first one decides
+        if (r->mode == RESERVE_THP && (!thp_enabled() || madvise(addr, len, MADV_HUGEPAGE) < 0))
+            r->mode = RESERVE_4K;
+    }
+
+    unsigned long nodemask = 1UL << rn->node;
+    PERR(mbind(addr, len, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0) < 0,
+            "emu: mbind reservation");
+}
+
+// Lock [rn->size, size) with the workers, or release [size, rn->size)
+static void reserve_node_resize(struct reservation *r, struct reserve_node *rn, size_t size)
+{
+    size = size / r->align * r->align;
+    if (size > rn->max_size)
+        size = rn->max_size;
+
+    if (size < rn->size) {
+        char *start = rn->ptr + size;
+        size_t len = rn->size - size;
+
+        if (r->mode == RESERVE_HUGETLB) {
+            // Replace the range to return the pages to the pool, then
+            // shrink the pool to return them to the node
+            long n = len / (r->hugetlb_kb * KB);
+            reserve_map(r, rn, start, len);
+            hugetlb_shrink(rn->node, r->hugetlb_kb, n);
+            rn->hugetlb_added -= n;
+        } else {
+            PERR(munlock(start, len) < 0, "emu: munlock reservation");
+            PERR(madvise(start, len, MADV_DONTNEED) < 0, "emu: release reservation");
+        }
+    } else if (size > rn->size) {
+        if (r->mode == RESERVE_HUGETLB) {
+            long want = (size - rn->size) / (r->hugetlb_kb * KB);
+            long added = hugetlb_grow(rn->node, r->hugetlb_kb, size - rn->size);
+            rn->hugetlb_added += added;
+            if (added < want) {
+                fprintf(stderr, "emu: warning: only %ld of %ld huge pages available on node %d\n",
+                        added, want, rn->node);
+                size = rn->size + added * r->hugetlb_kb * KB;
+            }
+        }
+
+        size_t next = rn->size;
+        struct reserve_worker *workers = calloc(rn->nworkers, sizeof(*workers));
+        PERR(!workers, "emu: reservation workers");
+
+        unsigned int cpu = 0;
+        for (int i = 0; i < rn->nworkers; i++) {
+            struct reserve_worker *w = &workers[i];
+            w->rn = rn;
+            w->next = &next;
+            w->end = size;
+
+            while (cpu < rn->cpus->size && !numa_bitmask_isbitset(rn->cpus, cpu))
+                cpu++;
+
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (cpu < rn->cpus->size) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+                cpu++;
+            }
+            errno = pthread_create(&w->thread, &attr, reserve_worker_main, w);
+            PERR(errno, "emu: start reservation worker");
+            pthread_attr_destroy(&attr);
+        }
+
+        int err = 0;
+        for (int i = 0; i < rn->nworkers; i++) {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].err)
+                err = workers[i].err;
+        }
+        free(workers);
+
+        errno = err;
+        PERR(err, "emu: mlock, is the memlock rlimit too low?");
+    }
+    r->size += size - rn->size;
+    rn->size = size;
+}
+
+// Resize the reservation so that avail bytes of local memory are left, an
+// equal share on each local node. Safe to call from a thread other than the
+// main loop.
+void reserve_resize(struct reservation *r, long long avail)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int i = 0; i < r->n; i++) {
+        struct reserve_node *rn = &r->node[i];
+        long long node_free = 0;
+        numa_node_size64(rn->node, &node_free);
+
+        long long size = (long long)rn->size + node_free - avail / r->n;
+        reserve_node_resize(r, rn, size > 0 ? size : 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->time = timespec_diff(&t0, &t1);
+}
+
+// Map address space for all of each local node, and reserve all but avail
+// bytes of local memory unless avail is negative
+void reserve_create(struct reservation *r, long long avail, bool hugetlb)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->mode = RESERVE_THP;
+    r->align = THP_SIZE;
+    if (hugetlb) {
+        r->hugetlb_kb = hugetlb_page_kb();
+        bool pools = r->hugetlb_kb > 0;
+        for (int i = 0; pools && i < topology.nlocal; i++)
+            pools = hugetlb_pool(topology.nodes[i], r->hugetlb_kb, "nr_hugepages", -1) >= 0;
+        if (pools) {
+            r->mode = RESERVE_HUGETLB;
+            r->align = r->hugetlb_kb * KB;
+        } else {
+            fprintf(stderr, "emu: warning: no hugetlb pool on the local nodes, using THP\n");
+        }
+    }
+
+    for (int i = 0; i < topology.nlocal; i++) {
+        struct reserve_node *rn = &r->node[r->n++];
+        rn->node = topology.nodes[i];
+
+        long long total = numa_node_size64(rn->node, NULL);
+        PERR(total < 0, "emu: size of local node");
+        rn->max_size = total / r->align * r->align;
+        reserve_map(r, rn, NULL, rn->max_size + r->align);
+
+        // One worker per CPU of the node
+        rn->cpus = numa_allocate_cpumask();
+        PERR(numa_node_to_cpus(rn->node, rn->cpus) < 0, "emu: cpus of local node");
+        rn->nworkers = numa_bitmask_weight(rn->cpus);
+        if (rn->nworkers < 1)
+            rn->nworkers = 1;
+        r->nworkers += rn->nworkers;
+    }
+
+    if (avail >= 0) {
+        reserve_resize(r, avail);
+        overhead_add(OVERHEAD_RESERVE, r->time);
+        printf("emu: reservedGB %.2f mode %s threads %d reserves %.2f\n",
+                r->size/(float)GB, reserve_mode_names[r->mode], r->nworkers, r->time);
+        for (int i = 0; r->n > 1 && i < r->n; i++)
+            printf("emu: reserve node %d reservedGB %.2f threads %d\n",
+                    r->node[i].node, r->node[i].size/(float)GB, r->node[i].nworkers);
+    }
+}
+
+void reserve_destroy(struct reservation *r)
+{
+    for (int i = 0; i < r->n; i++) {
+        struct reserve_node *rn = &r->node[i];
+        munmap(rn->map, rn->map_size);
+
+        if (rn->hugetlb_added > 0)
+            hugetlb_shrink(rn->node, r->hugetlb_kb, rn->hugetlb_added);
+
+        numa_free_cpumask(rn->cpus);
+    }
+    r->n = 0;
+}
+
+// Runtime changes of the local capacity, from a schedule file (-C) and/or
+// commands on a Unix socket (-U). Resizing the reservation can take seconds,
+// so it runs on a separate thread that signals completion through an
+// eventfd in the epoll set. A change requested while one is in progress
+// replaces any earlier pending one.
+#define CAPACITY_CLIENTS 16
+#define CAPACITY_LINE_MAX 256
+
+struct capacity_step {
+    double time;
+    long long avail;
+};
+
+// Commands may arrive split across reads, a partial line is kept here
+struct capacity_client {
+    int fd;
+    size_t len;
+    char line[CAPACITY_LINE_MAX];
+};
+
+struct capacity {
+    struct reservation *r;
+    struct capacity_step *steps;
+    int nsteps, next_step;
+    int timerfd;
+    int listenfd;
+    const char *socket_path;
+    struct capacity_client clients[CAPACITY_CLIENTS];
+    int eventfd;
+    pthread_t thread;
+    bool busy;
+    long long pending;
+    // Free bytes the running resize aims for
+    long long target;
+    double start_time;
+};
+
+bool parse_size(const char *s, long long *size)
+{
+    char *end = NULL;
+    double v = strtod(s, &end);
+
+    if (end == s)
+        return false;
+
+    switch (tolower(*end)) {
+    case 'g':
+        *size = v * GB;
+        break;
+    case 'm':
+        *size = v * MB;
+        break;
+    case 'k':
+        *size = v * KB;
+        break;
+    case '\0':
+    case '\n':
+        *size = v;
+        return true;
+    default:
+        return false;
+    }
+
+    end++;
+    return *end == '\0' || *end == '\n';
+}
+
+static void capacity_arm(struct capacity *c)
+{
+    struct itimerspec its = {};
+
+    if (c->next_step < c->nsteps) {
+        double at = c->steps[c->next_step].time;
+        its.it_value.tv_sec = (time_t)at;
+        its.it_value.tv_nsec = (at - (time_t)at) * 1e9;
+        // A zero value would disarm the timer
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;
+    }
+    PERR(timerfd_settime(c->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0,
+            "emu: arm capacity timer");
+}
+
+static void capacity_read_schedule(struct capacity *c, const char *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        sprintf(tmp, "emu: can't open schedule '%s'", fname);
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    int cap = 0, lineno = 0;
+    while (fgets(tmp, sizeof(tmp), fp)) {
+        lineno++;
+
+        char *p = tmp;
+        while (isspace(*p))
+            p++;
+        if (*p == '#' || *p == '\0')
+            continue;
+
+        struct capacity_step step;
+        char size[64];
+        if (sscanf(p, "%lf %63s", &step.time, size) != 2 ||
+                !parse_size(size, &step.avail) ||
+                (c->nsteps && step.time < c->steps[c->nsteps-1].time)) {
+            fprintf(stderr, "emu: %s:%d: expected 'seconds size' in time order\n",
+                    fname, lineno);
+            exit(EXIT_FAILURE);
+        }
+
+        if (c->nsteps == cap) {
+            cap = cap ? 2*cap : 16;
+            c->steps = realloc(c->steps, cap * sizeof(*c->steps));
+            PERR(!c->steps, "emu: schedule");
+        }
+        c->steps[c->nsteps++] = step;
+    }
+    fclose(fp);
+}
+
+void capacity_init(struct capacity *c, struct reservation *r,
+        const char *schedule, const char *socket_path, int epfd)
+{
+    memset(c, 0, sizeof(*c));
+    c->r = r;
+    c->pending = -1;
+    c->timerfd = -1;
+    c->listenfd = -1;
+    for (int i = 0; i < CAPACITY_CLIENTS; i++)
+        c->clients[i].fd = -1;
+    c->target = -1;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+
+    c->eventfd = eventfd(0, EFD_CLOEXEC);
+    PERR(c->eventfd < 0, "emu: eventfd");
+    ev.data.fd = c->eventfd;
+    PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, c->eventfd, &ev) < 0, "emu: add eventfd to epoll");
+
+    if (schedule) {
+        capacity_read_schedule(c, schedule);
+
+        // Schedule times are relative to emu start, like the time column
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        c->start_time = now.tv_sec + 1e-9*now.tv_nsec - get_time();
+        for (int i = 0; i < c->nsteps; i++)
+            c->steps[i].time += c->start_time;
+
+        c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        PERR(c->timerfd < 0, "emu: timerfd_create");
+        ev.data.fd = c->timerfd;
+        PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, c->timerfd, &ev) < 0, "emu: add timerfd to epoll");
+        capacity_arm(c);
+    }
+
+    if (socket_path) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "emu: socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        c->socket_path = socket_path;
+
+        c->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        PERR(c->listenfd < 0, "emu: control socket");
+        PERR(bind(c->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0, "emu: bind control socket");
+        PERR(listen(c->listenfd, 8) < 0, "emu: listen on control socket");
+        ev.data.fd = c->listenfd;
+        PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, c->listenfd, &ev) < 0, "emu: add control socket to epoll");
+    }
+}
+
+static void *capacity_thread(void *arg)
+{
+    struct capacity *c = arg;
+
+    reserve_resize(c->r, c->target);
+
+    uint64_t one = 1;
+    if (write(c->eventfd, &one, sizeof(one)) != sizeof(one))
+        perror("emu: capacity eventfd");
+    return NULL;
+}
+
+// Leave avail bytes of local memory free
+void capacity_set(struct capacity *c, long long avail)
+{
+    printf("emu: capacity target freeGB %.2f time %.*f\n", avail/(float)GB, time_digits, get_time());
+
+    if (c->busy) {
+        c->pending = avail;
+        return;
+    }
+
+    c->target = avail;
+    c->busy = true;
+
+    errno = pthread_create(&c->thread, NULL, capacity_thread, c);
+    PERR(errno, "emu: start capacity thread");
+}
+
+static void capacity_drop(struct capacity_client *cl)
+{
+    close(cl->fd);
+    cl->fd = -1;
+}
+
+// Replies are sent without blocking, a client that doesn't read them is
+// dropped
+static void capacity_reply(struct capacity_client *cl, const char *reply)
+{
+    size_t len = strlen(reply);
+    ssize_t n = send(cl->fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t)len)
+        return;
+
+    if (n >= 0 || errno == EAGAIN)
+        fprintf(stderr, "emu: warning: control socket: dropping client that is not reading\n");
+    else
+        perror("emu: control socket reply");
+    capacity_drop(cl);
+}
+
+// Commands are one per line, a closed connection is removed from epoll
+// by close().
+static void capacity_command(struct capacity *c, struct capacity_client *cl)
+{
+    ssize_t n = read(cl->fd, cl->line + cl->len, sizeof(cl->line) - 1 - cl->len);
+    if (n <= 0) {
+        if (n == 0 || errno != EAGAIN)
+            capacity_drop(cl);
+        return;
+    }
+    cl->len += n;
+
+    char *line = cl->line, *end;
+    while ((end = memchr(line, '\n', cl->line + cl->len - line))) {
+        *end = '\0';
+        long long avail;
+        if (strncmp(line, "capacity ", 9) == 0 && parse_size(line + 9, &avail) && avail >= 0) {
+            capacity_set(c, avail);
+            capacity_reply(cl, "ok\n");
+        } else {
+            capacity_reply(cl, "error: expected 'capacity size'\n");
+        }
+        if (cl->fd < 0)
+            return;
+        line = end + 1;
+    }
+
+    cl->len -= line - cl->line;
+    memmove(cl->line, line, cl->len);
+    if (cl->len == sizeof(cl->line) - 1) {
+        fprintf(stderr, "emu: warning: control socket: dropping client with a too long line\n");
+        capacity_drop(cl);
+    }
+}
+
+// Handle an epoll event, returns false if fd is not ours.
+bool capacity_handle(struct capacity *c, int fd, int epfd)
+{
+    if (fd == c->eventfd) {
+        uint64_t v;
+        PERR(read(fd, &v, sizeof(v)) != sizeof(v), "emu: read capacity eventfd");
+        pthread_join(c->thread, NULL);
+        c->busy = false;
+        overhead_add(OVERHEAD_RESERVE, c->r->time);
+
+        printf("emu: capacity reservedGB %.2f availGB %.2f resizes %.2f time %.*f\n",
+                c->r->size/(float)GB, topology_free(0, NULL)/(float)GB, c->r->time,
+                time_digits, get_time());
+
+        if (c->pending >= 0) {
+            long long avail = c->pending;
+            c->pending = -1;
+            capacity_set(c, avail);
+        }
+    } else if (fd == c->timerfd) {
+        uint64_t v;
+        PERR(read(fd, &v, sizeof(v)) != sizeof(v), "emu: read capacity timer");
+
+        // Several steps may be due, only the last one matters
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double t = now.tv_sec + 1e-9*now.tv_nsec;
+        long long avail = -1;
+        while (c->next_step < c->nsteps && c->steps[c->next_step].time <= t)
+            avail = c->steps[c->next_step++].avail;
+
+        if (avail >= 0)
+            capacity_set(c, avail);
+        capacity_arm(c);
+    } else if (fd == c->listenfd) {
+        int client = accept4(c->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0)
+            return true;
+
+        int i = 0;
+        while (i < CAPACITY_CLIENTS && c->clients[i].fd >= 0)
+            i++;
+        if (i == CAPACITY_CLIENTS) {
+            fprintf(stderr, "emu: warning: too many control connections\n");
+            close(client);
+            return true;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = client;
+        PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0, "emu: add control client to epoll");
+        c->clients[i].fd = client;
+        c->clients[i].len = 0;
+    } else {
+        for (int i = 0; i < CAPACITY_CLIENTS; i++) {
+            if (c->clients[i].fd == fd) {
+                capacity_command(c, &c->clients[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+void capacity_destroy(struct capacity *c)
+{
+    if (c->busy)
+        pthread_join(c->thread, NULL);
+
+    for (int i = 0; i < CAPACITY_CLIENTS; i++) {
+        if (c->clients[i].fd >= 0)
+            close(c->clients[i].fd);
+    }
+    if (c->listenfd >= 0) {
+        close(c->listenfd);
+        unlink(c->socket_path);
+    }
+    if (c->timerfd >= 0)
+        close(c->timerfd);
+    close(c->eventfd);
+    free(c->steps);
+}
+
+// Memory profiler state: the target, and optionally its process tree,
+// idle page tracking in place of clear_refs, the per-region breakdown and
+// the page access trace of the target.
+struct memprof {
+    int pid;
+    struct proc_tree *tree;
+    struct idle_tracker *idle;
+    struct smaps_regions *regions;
+    struct dirty_tracker *dirty;
+    struct access_trace *trace;
+};
+
+static bool memprof_sample_one(struct memprof *mp, int pid, bool required,
+        struct memprof_stats *st)
+{
+    // Regions are only tracked for the target, its totals come from the
+    // same pass over smaps.
+    if (mp->regions && pid == mp->pid) {
+        if (!regions_parse(mp->regions, pid, required, st))
+            return false;
+        st->scan_time = mp->regions->parse_time;
+    } else if (!memprof_read(pid, st, required)) {
+        return false;
+    }
+
+    // The trace walk also does the idle scan of the target
+    if (mp->trace && pid == mp->pid) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        long pages = trace_scan(mp->trace, pid, required);
+        if (pages < 0)
+            return false;
+        if (mp->idle)
+            st->ref = pages * (sysconf(_SC_PAGESIZE) / KB);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        st->scan_time += timespec_diff(&t0, &t1);
+    } else if (mp->idle) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        long pages = idle_scan(mp->idle, pid, required);
+        if (pages < 0)
+            return false;
+        st->ref = pages * (sysconf(_SC_PAGESIZE) / KB);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        st->scan_time += timespec_diff(&t0, &t1);
+    }
+
+    if (mp->dirty) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        long pages = dirty_scan(mp->dirty, pid, required);
+        if (pages < 0)
+            return false;
+        st->dirty = pages * (sysconf(_SC_PAGESIZE) / KB);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        st->scan_time += timespec_diff(&t0, &t1);
+    }
+    return true;
+}
+
+static void memprof_print_sample(struct memprof *mp, int pid,
+        const struct memprof_stats *st, int procs)
+{
+    char extra[128] = "";
+    size_t len = 0;
+
+    if (mp->dirty) {
+        float writehot = st->rss ? (float)st->dirty / (float)st->rss : 0;
+        len += snprintf(extra + len, sizeof(extra) - len, " dirtyKB %zu writehot %.4f",
+                st->dirty, writehot);
+    }
+    if (mp->idle || mp->regions || mp->dirty || mp->trace)
+        len += snprintf(extra + len, sizeof(extra) - len, " scanms %.3f", 1e3 * st->scan_time);
+    if (procs >= 0)
+        len += snprintf(extra + len, sizeof(extra) - len, " procs %d", procs);
+
+    memprof_print(pid, st, extra);
+}
+
+void memprof_sample(struct memprof *mp)
+{
+    struct proc_tree *t = mp->tree;
+    struct memprof_stats sum = {};
+    int n = 0;
+
+    if (t)
+        proc_tree_refresh(t);
+
+    for (int i = 0; i < (t ? t->n : 1); i++) {
+        int pid = t ? t->procs[i].pid : mp->pid;
+        struct memprof_stats st;
+        if (!memprof_sample_one(mp, pid, !t, &st))
+            continue;
+
+        if (t)
+            memprof_print_sample(mp, pid, &st, -1);
+        sum.rss += st.rss;
+        sum.pss += st.pss;
+        sum.ref += st.ref;
+        sum.anon += st.anon;
+        sum.dirty += st.dirty;
+        sum.scan_time += st.scan_time;
+        n++;
+    }
+
+    memprof_print_sample(mp, 0, &sum, t ? n : -1);
+
+    if (mp->regions)
+        regions_print(mp->regions, get_time());
+
+    if (mp->idle)
+        mp->idle->fresh = true;
+}
+
+// Reset referenced (and soft-dirty) bits of the target, or of every process
+// in the tree as of the last refresh. With idle page tracking the last
+// sample already marked the pages idle. A trace without idle page tracking
+// needs the soft-dirty bits cleared too.
+void memprof_reset(struct memprof *mp)
+{
+    struct proc_tree *t = mp->tree;
+    bool idle_done = mp->idle && mp->idle->fresh;
+
+    if (mp->idle)
+        mp->idle->fresh = false;
+
+    for (int i = 0; i < (t ? t->n : 1); i++) {
+        int pid = t ? t->procs[i].pid : mp->pid;
+        if (!mp->idle)
+            memprof_clear_refs(pid, 1, !t);
+        else if (!idle_done)
+            idle_scan(mp->idle, pid, !t);
+
+        if (mp->dirty || (mp->trace && !mp->idle))
+            memprof_clear_refs(pid, 4, !t);
+    }
+}
+
+// Node-level coordination of the emu instances of a job (-N key). The first
+// emu on the node creates a shared memory segment and becomes the
+// coordinator: it reserves local memory, then releases the other instances,
+// which wait on a barrier before starting their targets so that nothing is
+// allocated before the reservation is in place. Every instance registers its
+// target, and only the coordinator samples, one line per rank and a node
+// total, so a node runs one sampler instead of one per rank. The
+// coordinator keeps running until all registered ranks have exited. emu
+// processes are told apart from later processes with the same pid by their
+// start time.
+#define NODE_MAGIC 0x656d756e
+#define NODE_MAX_RANKS 1024
+// Seconds for the creator of a segment to initialize it
+#define NODE_OPEN_TIMEOUT 10
+
+struct node_rank {
+    int pid;
+    int emu_pid;
+    unsigned long long emu_start;
+    int rank;
+    bool active;
+};
+
+struct node_shm {
+    uint32_t magic;
+    int coordinator;
+    unsigned long long coordinator_start;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool ready;
+    int n;
+    struct node_rank ranks[NODE_MAX_RANKS];
+};
+
+struct node {
+    char name[NAME_MAX];
+    struct node_shm *shm;
+    bool coordinator;
+    int slot;
+    // Coordinator only, numa_maps of each slot and the pid it is open for
+    struct numa_maps *nm;
+    int *nm_pid;
+};
+
+// Start time from /proc/pid/stat in clock ticks after boot, 0 if the
+// process is gone
+static unsigned long long pid_start(int pid)
+{
+    char fname[64], buf[1024];
+    snprintf(fname, sizeof(fname), "/proc/%d/stat", pid);
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    // The command name may contain spaces, starttime is the 20th field after it
+    char *p = strrchr(buf, ')');
+    unsigned long long start;
+    if (!p || sscanf(p + 1, " %*c" " %*s %*s %*s %*s %*s %*s %*s %*s %*s"
+                " %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu", &start) != 1)
+        return 0;
+    return start;
+}
+
+static bool pid_alive(int pid, unsigned long long start)
+{
+    if (kill(pid, 0) < 0 && errno != EPERM)
+        return false;
+    return pid_start(pid) == start;
+}
+
+static void node_lock(struct node *node)
+{
+    // A process holding the lock may have been killed
+    if (pthread_mutex_lock(&node->shm->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&node->shm->lock);
+}
+
+static void node_unlock(struct node *node)
+{
+    pthread_mutex_unlock(&node->shm->lock);
+}
+
+static void node_create(struct node *node, int fd)
+{
+    PERR(ftruncate(fd, sizeof(struct node_shm)) < 0, "emu: size node segment");
+    node->shm = mmap(NULL, sizeof(struct node_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PERR(node->shm == MAP_FAILED, "emu: map node segment");
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&node->shm->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&node->shm->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    node->shm->coordinator = getpid();
+    node->shm->coordinator_start = pid_start(getpid());
+    __atomic_store_n(&node->shm->magic, NODE_MAGIC, __ATOMIC_RELEASE);
+    node->coordinator = true;
+
+    node->nm = calloc(NODE_MAX_RANKS, sizeof(*node->nm));
+    node->nm_pid = calloc(NODE_MAX_RANKS, sizeof(*node->nm_pid));
+    PERR(!node->nm || !node->nm_pid, "emu: node ranks");
+}
+
+static bool node_stale(struct node *node)
+{
+    fprintf(stderr, "emu: warning: removing stale node segment %s\n", node->name);
+    if (node->shm)
+        munmap(node->shm, sizeof(struct node_shm));
+    node->shm = NULL;
+    shm_unlink(node->name);
+    return false;
+}
+
+// Map an existing segment once its creator has initialized it. Returns
+// false if the creator died, or did not initialize it within
+// NODE_OPEN_TIMEOUT, the segment is then removed to start over.
+static bool node_open(struct node *node, int fd)
+{
+    double deadline = get_time() + NODE_OPEN_TIMEOUT;
+    struct stat st;
+    for (;;) {
+        PERR(fstat(fd, &st) < 0, "emu: node segment");
+        if (st.st_size >= (off_t)sizeof(struct node_shm))
+            break;
+        if (get_time() > deadline)
+            return node_stale(node);
+        usleep(10000);
+    }
+
+    node->shm = mmap(NULL, sizeof(struct node_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PERR(node->shm == MAP_FAILED, "emu: map node segment");
+
+    while (__atomic_load_n(&node->shm->magic, __ATOMIC_ACQUIRE) != NODE_MAGIC) {
+        if (get_time() > deadline)
+            return node_stale(node);
+        usleep(10000);
+    }
+
+    if (!pid_alive(node->shm->coordinator, node->shm->coordinator_start))
+        return node_stale(node);
+    return true;
+}
+
+void node_attach(struct node *node, const char *key)
+{
+    memset(node, 0, sizeof(*node));
+    node->slot = -1;
+    snprintf(node->name, sizeof(node->name), "/emu.%s", key);
+
+    for (;;) {
+        int fd = shm_open(node->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            node_create(node, fd);
+            close(fd);
+            break;
+        }
+        PERR(errno != EEXIST, "emu: create node segment");
+
+        fd = shm_open(node->name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0 && errno == ENOENT)
+            continue;
+        PERR(fd < 0, "emu: open node segment");
+
+        bool ok = node_open(node, fd);
+        close(fd);
+        if (ok)
+            break;
+    }
+
+    printf("emu: node %s %s\n", node->name + 1, node->coordinator ? "coordinator" : "member");
+}
+
+// Called by the coordinator once the reservation is in place
+void node_release(struct node *node)
+{
+    node_lock(node);
+    node->shm->ready = true;
+    pthread_cond_broadcast(&node->shm->cond);
+    node_unlock(node);
+}
+
+void node_wait(struct node *node)
+{
+    node_lock(node);
+    while (!node->shm->ready) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec++;
+        if (pthread_cond_timedwait(&node->shm->cond, &node->shm->lock, &ts) == EOWNERDEAD)
+            pthread_mutex_consistent(&node->shm->lock);
+
+        if (!node->shm->ready &&
+                !pid_alive(node->shm->coordinator, node->shm->coordinator_start)) {
+            fprintf(stderr, "emu: node coordinator exited before reserving memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    node_unlock(node);
+}
+
+void node_register(struct node *node, int pid, int rank)
+{
+    node_lock(node);
+    struct node_shm *shm = node->shm;
+    int slot = 0;
+    while (slot < shm->n && shm->ranks[slot].active)
+        slot++;
+    if (slot == NODE_MAX_RANKS) {
+        node_unlock(node);
+        fprintf(stderr, "emu: warning: more than %d ranks on the node, rank %d is not sampled\n",
+                NODE_MAX_RANKS, rank);
+        return;
+    }
+    if (slot == shm->n)
+        shm->n++;
+
+    shm->ranks[slot] = (struct node_rank){
+        .pid = pid, .emu_pid = getpid(), .emu_start = pid_start(getpid()),
+        .rank = rank, .active = true,
+    };
+    node->slot = slot;
+    node_unlock(node);
+}
+
+void node_unregister(struct node *node)
+{
+    if (node->slot < 0)
+        return;
+
+    node_lock(node);
+    node->shm->ranks[node->slot].active = false;
+    node_unlock(node);
+    node->slot = -1;
+}
+
+// Number of registered ranks other than the coordinator's own. Ranks whose
+// emu was killed are dropped.
+int node_others(struct node *node)
+{
+    int n = 0;
+
+    node_lock(node);
+    for (int i = 0; i < node->shm->n; i++) {
+        struct node_rank *r = &node->shm->ranks[i];
+        if (!r->active || i == node->slot)
+            continue;
+        if (!pid_alive(r->emu_pid, r->emu_start))
+            r->active = false;
+        else
+            n++;
+    }
+    node_unlock(node);
+    return n;
+}
+
+void node_sample(struct node *node)
+{
+    struct node_rank ranks[NODE_MAX_RANKS];
+    long long node_bytes[2] = {}, by_node[NODES_MAX] = {};
+    double sample_time = 0;
+    int n = 0, nranks;
+
+    node_lock(node);
+    nranks = node->shm->n;
+    memcpy(ranks, node->shm->ranks, nranks * sizeof(ranks[0]));
+    node_unlock(node);
+
+    for (int i = 0; i < nranks; i++) {
+        if (!ranks[i].active)
+            continue;
+
+        struct numa_maps *nm = &node->nm[i];
+        if (node->nm_pid[i] != ranks[i].pid) {
+            if (node->nm_pid[i])
+                numa_maps_close(nm);
+            numa_maps_init(nm, ranks[i].pid, false);
+            nm->file.optional = true;
+            node->nm_pid[i] = ranks[i].pid;
+        }
+        if (!numa_maps_sample(nm))
+            continue;
+
+        char extra[32];
+        snprintf(extra, sizeof(extra), " rank %d", ranks[i].rank);
+        emu_print_stats(ranks[i].pid, nm->node_bytes, nm->by_node, nm->parse_time, extra);
+        node_bytes[0] += nm->node_bytes[0];
+        node_bytes[1] += nm->node_bytes[1];
+        for (int node = 0; node < NODES_MAX; node++)
+            by_node[node] += nm->by_node[node];
+        sample_time += nm->parse_time;
+        n++;
+    }
+
+    char extra[32];
+    snprintf(extra, sizeof(extra), " ranks %d", n);
+    emu_print_stats(0, node_bytes, by_node, sample_time, extra);
+}
+
+void node_detach(struct node *node)
+{
+    node_unregister(node);
+    munmap(node->shm, sizeof(struct node_shm));
+    if (node->coordinator) {
+        shm_unlink(node->name);
+        for (int i = 0; i < NODE_MAX_RANKS; i++) {
+            if (node->nm_pid[i])
+                numa_maps_close(&node->nm[i]);
+        }
+        free(node->nm);
+        free(node->nm_pid);
+    }
+}
+
+// Sample the ranks of the node, the process tree, the cgroup or the target
+// with numa_maps
+void emu_sample(struct numa_maps *nm, struct cgroup *cg, struct proc_tree *t,
+        struct node *node)
+{
+    if (node) {
+        if (node->coordinator)
+            node_sample(node);
+        return;
+    }
+
+    if (t)
+        emu_show_tree_stats(t);
+    else if (cg)
+        cgroup_show_stats(cg);
+    else
+        emu_show_stats(nm);
+
+    if (nm->page_sizes)
+        emu_show_node_huge_pages();
+}
+
+// Sampling interval. It is fixed by default. With -a it adapts between the
+// -t interval and a maximum: back to the minimum when the footprint or the
+// hot fraction changed noticeably since the last sample, doubling otherwise.
+// With -B it is stretched so that the time spent sampling stays below a
+// fraction of the run time.
+#define ADAPT_SIZE_CHANGE 0.05
+#define ADAPT_HOT_CHANGE 0.05
+
+struct sampler {
+    double interval, min, max;
+    double budget;
+    // Moving average of the time per sample
+    double cost;
+    double last_size, last_hot;
+};
+
+// Seconds, with an optional s/ms/us suffix
+bool parse_interval(const char *s, double *sec)
+{
+    char *end = NULL;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0)
+        return false;
+
+    if (strcmp(end, "ms") == 0)
+        v *= 1e-3;
+    else if (strcmp(end, "us") == 0)
+        v *= 1e-6;
+    else if (*end != '\0' && strcmp(end, "s") != 0)
+        return false;
+
+    *sec = v;
+    return true;
+}
+
+static struct timespec sec_to_timespec(double sec)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)sec;
+    ts.tv_nsec = (sec - ts.tv_sec) * 1e9;
+    return ts;
+}
+
+static bool sampler_dynamic(const struct sampler *s)
+{
+    return s->max > s->min || s->budget > 0;
+}
+
+// Interval until the next sample, given the time the last one took
+double sampler_next(struct sampler *s, double cost)
+{
+    s->cost = s->cost ? 0.8 * s->cost + 0.2 * cost : cost;
+    // Without -a the interval goes back to -t as soon as the budget allows
+    double next = s->min;
+
+    if (s->max > s->min) {
+        const struct emulog_record *n = &sample_log.last_nodes;
+        const struct emulog_record *m = &sample_log.last_memprof;
+        double size, hot = 0;
+
+        if (m->time > n->time) {
+            size = m->rss_kb * (double)KB;
+            hot = m->rss_kb ? (double)m->ref_kb / m->rss_kb : 0;
+        } else {
+            size = (n->node_pages[0] + n->node_pages[1]) * (double)sample_log.page_size;
+        }
+
+        double dsize = size > s->last_size ? size - s->last_size : s->last_size - size;
+        double dhot = hot > s->last_hot ? hot - s->last_hot : s->last_hot - hot;
+        if (dsize > ADAPT_SIZE_CHANGE * s->last_size || dhot > ADAPT_HOT_CHANGE)
+            next = s->min;
+        else
+            next = 2 * s->interval < s->max ? 2 * s->interval : s->max;
+
+        s->last_size = size;
+        s->last_hot = hot;
+    }
+
+    // The timer is armed after sampling, so a period is cost + interval
+    if (s->budget > 0 && next < s->cost / s->budget - s->cost)
+        next = s->cost / s->budget - s->cost;
+
+    // Budget adjustments follow the cost, only larger changes are printed
+    double change = next > s->interval ? next - s->interval : s->interval - next;
+    if (change > 0.1 * s->interval)
+        printf("emu: interval ms %.3f samplems %.3f time %.*f\n",
+                1e3 * next, 1e3 * s->cost, time_digits, get_time());
+    s->interval = next;
+    return next;
+}
+
+// Relay of the target output from the pty to our stdout. Whatever a read
+// returns is written out with one write, after any pending output of emu
+// itself, and complete lines are matched against the output patterns in
+// place in the buffer. The pty can't be spliced, since the bytes have to
+// be seen anyway. A line that does not fit grows the buffer, up to
+// RELAY_LINE_MAX, beyond which it is matched in pieces of that size.
+#define RELAY_BUF (64*KB)
+#define RELAY_LINE_MAX (1024*KB)
+#define RELAY_EOF -2
+
+struct relay {
+    int fd;
+    char *buf;
+    size_t size;
+    // Bytes held, start of the current line, newline scanned up to, and
+    // written up to
+    size_t len, line, scan, out;
+    bool eof;
+};
+
+void relay_init(struct relay *r, int fd)
+{
+    r->fd = fd;
+    r->size = RELAY_BUF;
+    // One more byte to terminate a line filling the buffer
+    r->buf = malloc(r->size + 1);
+    PERR(!r->buf, "emu: allocate relay buffer");
+    r->len = r->line = r->scan = r->out = 0;
+    r->eof = false;
+}
+
+static void relay_flush(struct relay *r, size_t end)
+{
+    fflush(stdout);
+    while (r->out < end) {
+        ssize_t n = write(STDOUT_FILENO, r->buf + r->out, end - r->out);
+        if (n < 0 && errno == EINTR)
+            continue;
+        PERR(n < 0, "emu: write target stdout");
+        r->out += n;
+    }
+}
+
+// Match the line at the start of the buffer ending at len, and drop it
+static int relay_last_line(struct relay *r)
+{
+    r->buf[r->len] = '\0';
+    int m = markers_match(r->buf, r->len);
+    r->len = r->line = r->scan = r->out = 0;
+    return m;
+}
+
+// Relay output until a line matches a pattern, and return the kinds matched
+// (see markers_match()) after writing the line out. Returns -1 when no more
+// output is available now, and RELAY_EOF when the target closed the pty.
+int relay_next(struct relay *r)
+{
+    if (r->eof)
+        return RELAY_EOF;
+
+    for (;;) {
+        while (r->scan < r->len) {
+            char *nl = memchr(r->buf + r->scan, '\n', r->len - r->scan);
+            if (!nl) {
+                r->scan = r->len;
+                break;
+            }
+
+            *nl = '\0';
+            int m = markers_match(r->buf + r->line, nl - r->buf - r->line);
+            *nl = '\n';
+            r->line = r->scan = nl - r->buf + 1;
+
+            if (m > 0) {
+                relay_flush(r, r->line);
+                return m;
+            }
+        }
+        relay_flush(r, r->len);
+
+        // Keep the incomplete line at the start of the buffer
+        if (r->line) {
+            memmove(r->buf, r->buf + r->line, r->len - r->line);
+            r->len -= r->line;
+            r->scan -= r->line;
+            r->out -= r->line;
+            r->line = 0;
+        }
+
+        if (r->len == r->size) {
+            if (r->size < RELAY_LINE_MAX) {
+                r->size *= 2;
+                r->buf = realloc(r->buf, r->size + 1);
+                PERR(!r->buf, "emu: grow relay buffer");
+            } else {
+                int m = relay_last_line(r);
+                if (m > 0)
+                    return m;
+            }
+        }
+
+        ssize_t n = read(r->fd, r->buf + r->len, r->size - r->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return -1;
+
+        // The pty master reads EIO once the target and its children closed
+        // the slave, which is the end of its output
+        if (n == 0 || (n < 0 && errno == EIO)) {
+            r->eof = true;
+            if (r->len) {
+                int m = relay_last_line(r);
+                if (m > 0)
+                    return m;
+            }
+            return RELAY_EOF;
+        }
+        PERR(n < 0, "emu: read target stdout");
+        r->len += n;
+    }
+}
+
+void relay_destroy(struct relay *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// Ring of phase markers from libemuphase in the target (emuphase.h). The
+// memfd and eventfd are inherited through fork and exec, and found by the
+// library through the environment. Created with -k only, without it the
+// calls of the target do nothing. A writer killed between claiming a slot
+// and publishing it would stop the ring, so an unpublished slot is skipped
+// once a later marker has been published for PHASE_RING_STALE seconds.
+#define PHASE_RING_STALE 0.01
+
+struct phase_ring {
+    int fd, efd;
+    struct emuphase_ring *ring;
+    uint64_t skipped;
+};
+
+void phase_ring_init(struct phase_ring *pr)
+{
+    pr->fd = memfd_create("emuphase", 0);
+    PERR(pr->fd < 0, "emu: create phase ring");
+    PERR(ftruncate(pr->fd, sizeof(*pr->ring)) < 0, "emu: size phase ring");
+
+    pr->ring = mmap(NULL, sizeof(*pr->ring), PROT_READ | PROT_WRITE, MAP_SHARED, pr->fd, 0);
+    PERR(pr->ring == MAP_FAILED, "emu: map phase ring");
+    pr->ring->magic = EMUPHASE_MAGIC;
+
+    pr->efd = eventfd(0, EFD_NONBLOCK);
+    PERR(pr->efd < 0, "emu: phase eventfd");
+
+    sprintf(tmp, "%d,%d", pr->fd, pr->efd);
+    PERR(setenv(EMUPHASE_ENV, tmp, 1) < 0, "emu: set " EMUPHASE_ENV);
+}
+
+// Seconds since the marker was written
+double phase_ring_latency(const struct emuphase_entry *e)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec * 1000000000LL + now.tv_nsec - (int64_t)e->time) * 1e-9;
+}
+
+// Whether a marker after the unpublished one at tail is published and old
+static bool phase_ring_stale(struct phase_ring *pr, uint64_t tail)
+{
+    uint64_t head = __atomic_load_n(&pr->ring->head, __ATOMIC_ACQUIRE);
+    for (uint64_t i = tail + 1; i < head && i < tail + EMUPHASE_SLOTS; i++) {
+        struct emuphase_entry *slot = &pr->ring->entry[i % EMUPHASE_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == i + 1)
+            return phase_ring_latency(slot) > PHASE_RING_STALE;
+    }
+    return false;
+}
+
+// Take the next published marker, if any
+bool phase_ring_next(struct phase_ring *pr, struct emuphase_entry *e)
+{
+    uint64_t tail = pr->ring->tail;
+    struct emuphase_entry *slot = &pr->ring->entry[tail % EMUPHASE_SLOTS];
+    while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+        if (!phase_ring_stale(pr, tail))
+            return false;
+        pr->skipped++;
+        __atomic_store_n(&pr->ring->tail, ++tail, __ATOMIC_RELEASE);
+        slot = &pr->ring->entry[tail % EMUPHASE_SLOTS];
+    }
+
+    *e = *slot;
+    e->name[EMUPHASE_NAME - 1] = '\0';
+    __atomic_store_n(&pr->ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Whether another marker is published already
+bool phase_ring_pending(struct phase_ring *pr)
 {
-    static struct timespec start = {};
+    uint64_t tail = pr->ring->tail;
+    struct emuphase_entry *slot = &pr->ring->entry[tail % EMUPHASE_SLOTS];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail + 1;
+}
 
-    if (start.tv_sec == 0 && start.tv_nsec == 0) {
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        return 0.0f;
-    } else {
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-	    return (now.tv_sec-start.tv_sec) + 1e-9*(now.tv_nsec-start.tv_nsec);
-    }
+// Whether markers wait behind an unpublished slot. Its writer may be gone
+// and later writers have signaled already, so emu checks on every sample.
+bool phase_ring_blocked(struct phase_ring *pr)
+{
+    uint64_t tail = pr->ring->tail;
+    return !phase_ring_pending(pr) && __atomic_load_n(&pr->ring->head, __ATOMIC_ACQUIRE) > tail;
 }
 
-// Parts borrowed from numastat (GPL)
-void emu_show_stats(int pid)
+void phase_ring_destroy(struct phase_ring *pr)
 {
-    char fname[64];
-    snprintf(fname, sizeof(fname), "/proc/%d/numa_maps", pid);
+    uint64_t dropped = __atomic_load_n(&pr->ring->dropped, __ATOMIC_RELAXED);
+    if (dropped)
+        printf("emu: marker dropped %lu\n", dropped);
+    if (pr->skipped)
+        printf("emu: marker skipped %lu\n", pr->skipped);
 
-    struct timespec time = {};
-    clock_gettime(CLOCK_MONOTONIC, &time);
+    munmap(pr->ring, sizeof(*pr->ring));
+    close(pr->fd);
+    close(pr->efd);
+}
 
-    FILE *fs = fopen(fname, "r");
-    if (!fs) {
-        sprintf(tmp, "emu: show_stats: can't read %s", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
-    }
+// Placement policies for the memory of the target (-X), besides -i and
+// -l 0. "weighted:N:M" interleaves pages over the local and far nodes with
+// MPOL_WEIGHTED_INTERLEAVE, weight N for each local node and M for each far
+// node. The node weights in sysfs are system-wide and shared with other emu
+// instances, so emu never writes them: the kernel is used only if the
+// current weights already give that ratio, and otherwise libemualloc stripes
+// each large allocation in the same ratio between the sets with mbind().
+// "preferred" prefers the local nodes for all allocations, falling back to
+// the others when they are full, whatever CPU the target runs on. "size:S"
+// places allocations of at least S bytes on the far nodes through
+// libemualloc, and leaves the smaller ones local.
+#ifndef MPOL_WEIGHTED_INTERLEAVE
+#define MPOL_WEIGHTED_INTERLEAVE 6
+#endif
+#ifndef MPOL_PREFERRED_MANY
+#define MPOL_PREFERRED_MANY 5
+#endif
+#define WEIGHTS_DIR "/sys/kernel/mm/mempolicy/weighted_interleave"
 
-    long long node_pages[2] = {};
+enum placement_mode {
+    PLACE_NONE,
+    PLACE_WEIGHTED,
+    PLACE_PREFERRED,
+    PLACE_SIZE,
+};
 
-    // Parse numa_maps
-    while (fgets(tmp, sizeof(tmp), fs)) {
-        const char *delimiters = " \t\r\n";
-        char *p = strtok(tmp, delimiters);
+static const char *placement_names[] = {"none", "weighted", "preferred", "size"};
 
-        while (p) {
-            if (p[0] == 'N') {
-                int node = (int)strtol(&p[1], &p, 10);
-                if (node != 0 && node != 1) {
-                    fprintf(stderr, "emu: warning: skipping data for node %d\n", node);
-                }
-                if (p[0] != '=') {
-                    fprintf(stderr, "emu: show_stats: node value parse error");
-                    exit(EXIT_FAILURE);
-                }
-                long pages = (double)strtol(&p[1], &p, 10);
-                node_pages[node] += pages;
-            } else if (strncmp(p, "huge", 4) == 0) {
-                fprintf(stderr, "emu: warning: skipping huge pages, not supported (yet)\n");
-            }
+struct placement {
+    enum placement_mode mode;
+    int weight[2];
+    long long size;
+    // Weighted interleave by the kernel rather than libemualloc
+    bool kernel;
+};
 
-            p = strtok(NULL, delimiters);
-        }
+bool placement_parse(struct placement *p, const char *arg)
+{
+    memset(p, 0, sizeof(*p));
+
+    int n = 0;
+    if (strcmp(arg, "preferred") == 0) {
+        p->mode = PLACE_PREFERRED;
+    } else if (strncmp(arg, "size:", 5) == 0) {
+        p->mode = PLACE_SIZE;
+        if (!parse_size(arg + 5, &p->size) || p->size <= 0)
+            return false;
+    } else if (sscanf(arg, "weighted:%d:%d%n", &p->weight[0], &p->weight[1], &n) == 2 &&
+            !arg[n]) {
+        p->mode = PLACE_WEIGHTED;
+        if (p->weight[0] < 1 || p->weight[0] > 255 || p->weight[1] < 1 || p->weight[1] > 255)
+            return false;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    long long total = node_pages[0] + node_pages[1];
-    float local_frac = node_pages[0] / (float)total;
-    printf("emu: local%% %3.2f localGB %.2f remoteGB %.2f totalGB %.2f time %.2f\n",
-            100.0f * local_frac,
-            numa_pagesize()*node_pages[0]/(float)GB,
-            numa_pagesize()*node_pages[1]/(float)GB,
-            numa_pagesize()*total/(float)GB,
-	        get_time());
+// Node weight of the kernel's weighted interleave, 0 if unknown
+static int weights_node(int node)
+{
+    char fname[128];
+    snprintf(fname, sizeof(fname), WEIGHTS_DIR "/node%d", node);
 
-    if (fclose(fs)) {
-        sprintf(tmp, "emu: can't close '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
-    }
+    FILE *fp = fopen(fname, "r");
+    if (!fp)
+        return 0;
+    int weight = 0;
+    if (fscanf(fp, "%d", &weight) != 1)
+        weight = 0;
+    fclose(fp);
+    return weight;
 }
 
-void memprof_clear_refs(int pid)
+// Set up the policy in emu before the target is started: check that the
+// kernel has weighted interleave by trying it on emu itself, and that the
+// node weights are proportional to those asked for.
+void placement_init(struct placement *p)
 {
-    char fname[64];
-    snprintf(fname, sizeof(fname), "/proc/%d/clear_refs", pid);
-    FILE *fp = fopen(fname, "w");
-    if (!fp) {
-        sprintf(tmp, "memprof: can't open '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
-    }
-    const char one[] = "1\n";
-    if (1 != fwrite(one, sizeof(one), 1, fp)) {
-        sprintf(tmp, "memprof: can't write to '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
-    }
-    if (fclose(fp)) {
-        sprintf(tmp, "memprof: can't close '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
+    if (p->mode != PLACE_WEIGHTED)
+        return;
+
+    unsigned long mask = topology.both->maskp[0];
+    if (set_mempolicy(MPOL_WEIGHTED_INTERLEAVE, &mask, sizeof(mask) * 8) < 0)
+        return;
+    PERR(set_mempolicy(MPOL_DEFAULT, NULL, 0) < 0, "emu: reset memory policy");
+
+    // Node i has weight k * p->weight[side of i] for some k, checked
+    // against the first node
+    int node0 = topology.nodes[0];
+    long w0 = weights_node(node0);
+    for (int i = 0; i < topology.n; i++) {
+        int node = topology.nodes[i];
+        long w = weights_node(node);
+        if (!w || w * p->weight[topology.side[node0]] != w0 * p->weight[topology.side[node]])
+            return;
     }
+    p->kernel = true;
 }
 
-void memprof_show_stats(int pid)
+// Policies that libemualloc applies
+void placement_preload(struct placement *p, struct alloc_sites *as)
 {
-    char fname[64];
-    snprintf(fname, sizeof(fname), "/proc/%d/smaps_rollup", pid);
-    FILE *fp = fopen(fname, "r");
-    if (!fp) {
-        sprintf(tmp, "memprof: can't open '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
+    if (p->mode == PLACE_SIZE) {
+        as->shm->place = EMUALLOC_PLACE_REMOTE;
+        as->shm->place_size = p->size;
+    } else if (p->mode == PLACE_WEIGHTED && !p->kernel) {
+        // The ratio of the sets that per-node weights would give
+        as->shm->place = EMUALLOC_PLACE_STRIPE;
+        as->shm->place_size = ALLOC_MIN_SIZE;
+        as->shm->weight[0] = p->weight[0] * topology.nlocal;
+        as->shm->weight[1] = p->weight[1] * (topology.n - topology.nlocal);
     }
+    as->shm->nodes[0] = topology.local->maskp[0];
+    as->shm->nodes[1] = topology.far->maskp[0];
+}
 
-    size_t rss = 0, pss = 0, ref = 0, anon = 0;
+// Whether libemualloc is needed
+bool placement_needs_preload(struct placement *p)
+{
+    return p->mode == PLACE_SIZE || (p->mode == PLACE_WEIGHTED && !p->kernel);
+}
 
-    while (fgets(tmp, sizeof(tmp), fp)) {
-        sscanf(tmp, "Rss: %zu kB", &rss);
-        sscanf(tmp, "Pss: %zu kB", &pss);
-        sscanf(tmp, "Referenced: %zu kB", &ref);
-        sscanf(tmp, "Anonymous: %zu kB", &anon);
-    }
+// In the child before exec
+void placement_apply(struct placement *p)
+{
+    unsigned long mask = topology.both->maskp[0];
+    unsigned long local = topology.local->maskp[0];
 
-    float hot = 0;
-    if (rss)
-        hot = (float)ref / (float)rss;
-    float time = get_time();
-    printf("memprof: rssKB %zu pssKB %zu refKB %zu hot %.4f time %.2f anonKB %zu\n",
-            rss, pss, ref, hot, time, anon);
+    if (p->mode == PLACE_WEIGHTED && p->kernel)
+        PERR(set_mempolicy(MPOL_WEIGHTED_INTERLEAVE, &mask, sizeof(mask) * 8) < 0,
+                "emu: set weighted interleave");
+    else if (p->mode == PLACE_PREFERRED && (topology.nlocal == 1 ||
+                set_mempolicy(MPOL_PREFERRED_MANY, &local, sizeof(local) * 8) < 0))
+        numa_set_preferred(topology.nodes[0]);
+}
 
-    if (fclose(fp)) {
-        sprintf(tmp, "memprof: can't close '%s'", fname);
-        perror(tmp);
-        exit(EXIT_FAILURE);
-    }
+// The split that was asked for, and the one in the last sample
+void placement_summary(struct placement *p)
+{
+    int len = snprintf(tmp, sizeof(tmp), "emu: placement %s", placement_names[p->mode]);
+    double local = p->weight[0] * topology.nlocal;
+    double far = p->weight[1] * (topology.n - topology.nlocal);
+    if (p->mode == PLACE_WEIGHTED)
+        len += snprintf(tmp + len, sizeof(tmp) - len, " ratio %d:%d by %s requestedlocal%% %.2f",
+                p->weight[0], p->weight[1], p->kernel ? "kernel" : "mbind",
+                100.0 * local / (local + far));
+    else if (p->mode == PLACE_PREFERRED)
+        len += snprintf(tmp + len, sizeof(tmp) - len, " requestedlocal%% 100.00");
+    else
+        len += snprintf(tmp + len, sizeof(tmp) - len, " sizeMB %.1f", (double)p->size / MB);
+
+    struct emulog_record *n = &sample_log.last_nodes;
+    uint64_t pages = n->node_pages[0] + n->node_pages[1];
+    if (pages)
+        len += snprintf(tmp + len, sizeof(tmp) - len, " local%% %.2f localGB %.2f remoteGB %.2f",
+                100.0 * n->node_pages[0] / pages,
+                (double)n->node_pages[0] * sample_log.page_size / GB,
+                (double)n->node_pages[1] * sample_log.page_size / GB);
+    printf("%s time %.*f\n", tmp, time_digits, get_time());
 }
+
 void usage(const char *argv0)
 {
-    fprintf(stderr, "usage: %s [-l size] [-i] PROG [ARGS ...]\n", argv0);
+    fprintf(stderr, "usage: %s [-l size [-H]] [-C schedule] [-U socket] [-i] [-L nodes] [-F nodes] [-P] [-N key] [-c cgroup] [-f] [-o log] [-s socket] [-M name=pattern] [-k] [-t interval [-a max]] [-B percent] [-O] [-p] [-T rate[:rate]] [-A top] [-X policy] [-m [-I] [-W] [-D trace] [-R top]] PROG [ARGS ...]\n", argv0);
 }
 
 int main(int argc, char **argv)
@@ -170,64 +5421,180 @@ int main(int argc, char **argv)
     int enable_emu = 1;
     int enable_memprof = 0;
     int rank = 0;
-    struct timespec interval = {};
-    interval.tv_sec = 1;
-    const char *start_pattern = NULL;
-    const char *end_pattern = NULL;
+    struct sampler sampler = {};
+    sampler.min = 1;
+    double budget_percent = 0;
+    bool start_pattern = false;
+    const char *cgroup_parent = NULL;
+    bool follow_tree = false;
+    bool memprof_idle = false;
+    bool memprof_dirty = false;
+    int memprof_regions = 0;
+    int alloc_top = 0;
+    struct placement placement = {};
+    double tier_promote = 0, tier_demote = 0;
 
     long long emu_local_size = -1;
     int emu_interleave = 0;
+    bool emu_hugetlb = false;
+    bool emu_page_sizes = false;
+    bool enable_phase_ring = false;
+    bool enable_perf = false;
+    const char *capacity_schedule = NULL;
+    const char *capacity_socket = NULL;
+    const char *sample_log_name = NULL;
+    const char *node_key = NULL;
+    const char *local_nodes = NULL, *far_nodes = NULL;
+    const char *metrics_path = NULL;
+    const char *trace_name = NULL;
 
-    while ((opt = getopt(argc, argv, "+l:in:t:mS:E:")) != -1) {
+    while ((opt = getopt(argc, argv, "+l:iHn:t:a:B:mS:E:M:kc:fIR:WD:T:C:U:Po:OpN:A:X:L:F:s:")) != -1) {
         switch (opt) {
         case 'l':
-        {
-            char *end = NULL;
-            double size = strtod(optarg, &end);
-
-            if (end == optarg) {
-                fprintf(stderr, "error: invalid size in -l option\n");
-                usage(argv[0]);
-                exit(EXIT_FAILURE);
-            }
-
-            switch (tolower(*end)) {
-            case 'g':
-                emu_local_size = size * GB;
-                break;
-            case 'm':
-                emu_local_size = size * MB;
-                break;
-            case 'k':
-                emu_local_size = size * KB;
-                break;
-            case '\0':
-                emu_local_size = size;
-                break;
-            default:
+            if (!parse_size(optarg, &emu_local_size)) {
                 fprintf(stderr, "error: invalid size in -l option\n");
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
-        } break;
+            break;
+        case 'C':
+            capacity_schedule = optarg;
+            break;
+        case 'U':
+            capacity_socket = optarg;
+            break;
         case 'i':
             emu_interleave = 1;
             break;
+        case 'H':
+            emu_hugetlb = true;
+            break;
+        case 'P':
+            emu_page_sizes = true;
+            break;
+        case 'k':
+            enable_phase_ring = true;
+            break;
+        case 'o':
+            sample_log_name = optarg;
+            break;
+        case 's':
+            metrics_path = optarg;
+            break;
+        case 'O':
+            overhead.column = true;
+            break;
+        case 'p':
+            enable_perf = true;
+            break;
+        case 'N':
+            node_key = optarg;
+            break;
+        case 'L':
+            local_nodes = optarg;
+            break;
+        case 'F':
+            far_nodes = optarg;
+            break;
         case 'n':
             rank = atoi(optarg);
             break;
         case 't':
-            interval.tv_sec = atoi(optarg);
+            if (!parse_interval(optarg, &sampler.min)) {
+                fprintf(stderr, "error: invalid interval in -t option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            if (!parse_interval(optarg, &sampler.max) || sampler.max <= 0) {
+                fprintf(stderr, "error: invalid interval in -a option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            budget_percent = atof(optarg);
+            if (budget_percent <= 0 || budget_percent >= 100) {
+                fprintf(stderr, "error: invalid overhead budget in -B option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
             break;
         case 'm':
             enable_emu = 0;
             enable_memprof = 1;
             break;
         case 'S':
-            start_pattern = optarg;
+            markers_add(MARKER_START, optarg, NULL);
+            start_pattern = true;
             break;
         case 'E':
-            end_pattern = optarg;
+            markers_add(MARKER_END, optarg, NULL);
+            break;
+        case 'M': {
+            char *eq = strchr(optarg, '=');
+            if (!eq || eq == optarg) {
+                fprintf(stderr, "error: -M takes name=pattern\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            *eq = '\0';
+            markers_add(MARKER_PHASE, eq + 1, optarg);
+            break;
+        }
+        case 'c':
+            cgroup_parent = optarg;
+            break;
+        case 'f':
+            follow_tree = true;
+            break;
+        case 'I':
+            memprof_idle = true;
+            break;
+        case 'W':
+            memprof_dirty = true;
+            break;
+        case 'D':
+            trace_name = optarg;
+            break;
+        case 'T':
+        {
+            char *end = NULL;
+            tier_promote = strtod(optarg, &end);
+            tier_demote = tier_promote;
+            if (*end == ':')
+                tier_demote = strtod(end + 1, &end);
+            if (end == optarg || *end || tier_promote <= 0 || tier_demote < 0) {
+                fprintf(stderr, "error: invalid rate in -T option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            tier_promote *= MB;
+            tier_demote *= MB;
+        } break;
+        case 'R':
+            memprof_regions = atoi(optarg);
+            if (memprof_regions <= 0) {
+                fprintf(stderr, "error: invalid number of regions in -R option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'X':
+            if (!placement_parse(&placement, optarg)) {
+                fprintf(stderr, "error: invalid policy in -X option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            alloc_top = atoi(optarg);
+            if (alloc_top <= 0) {
+                fprintf(stderr, "error: invalid number of sites in -A option\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
             break;
         default:
             usage(argv[0]);
@@ -240,16 +5607,94 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (tier_promote && !enable_emu) {
+        fprintf(stderr, "error: -T can't be combined with -m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const bool enable_capacity = capacity_schedule || capacity_socket;
+    if (enable_capacity && (!enable_emu || rank != 0)) {
+        fprintf(stderr, "error: -C and -U need emu mode on rank 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only rank 0 profiles, so other ranks would have nothing to trace
+    if (trace_name && rank != 0) {
+        fprintf(stderr, "error: -D needs rank 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (placement.mode && (!enable_emu || emu_interleave || emu_local_size == 0)) {
+        fprintf(stderr, "error: -X can't be combined with -m, -i or -l 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (node_key && (!enable_emu || follow_tree)) {
+        fprintf(stderr, "error: -N can't be combined with -m or -f\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!topology_init(local_nodes, far_nodes)) {
+        fprintf(stderr, "error: invalid or overlapping node sets in -L and -F options\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (trace_name && !enable_memprof) {
+        fprintf(stderr, "error: -D needs -m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Referenced in smaps is not maintained by idle page tracking
+    if (memprof_idle && memprof_regions) {
+        fprintf(stderr, "error: -R can't be combined with -I\n");
+        exit(EXIT_FAILURE);
+    }
+
     bool state_monitoring = true;
     if (start_pattern)
         state_monitoring = false;
 
-    const bool monitor_out = start_pattern || end_pattern;
+    const bool monitor_out = markers.n > 0;
+    if (monitor_out)
+        markers_compile();
+
+    sample_log_init(rank);
+    if (sample_log_name)
+        sample_log_open(sample_log_name);
+
+    if (sampler.max && sampler.max < sampler.min) {
+        fprintf(stderr, "error: -a interval is shorter than -t interval\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!sampler.max)
+        sampler.max = sampler.min;
+    sampler.interval = sampler.min;
+    sampler.budget = budget_percent / 100;
+
+    for (double t = sampler.min; t > 0 && t < 0.01 && time_digits < 6; t *= 10)
+        time_digits++;
 
     // Ensure output is interleaved with target app
     if (rank == 0)
         setlinebuf(stdout);
 
+    // Start of the time column in wall clock time, for agg to line up logs
+    // of ranks started at different times
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    printf("emu: sync %.6f\n", now.tv_sec + 1e-9*now.tv_nsec - get_time());
+
+    struct node node_state;
+    struct node *node = NULL;
+    if (node_key) {
+        node_attach(&node_state, node_key);
+        node = &node_state;
+    }
+
+    // Without -N rank 0 reserves memory, with -N the node coordinator
+    const bool reserver = node ? node->coordinator : rank == 0;
+
     // Block signals we will wait on with epoll
     sigset_t sigset;
     sigemptyset(&sigset);
@@ -262,7 +5707,8 @@ int main(int argc, char **argv)
     int sigfd = signalfd(-1, &sigset, 0);
     PERR(sigfd < 0, "emu: signalfd");
 
-    bool enable_timer = interval.tv_sec != 0;
+    // Members of a node leave sampling to the coordinator
+    bool enable_timer = sampler.min != 0 && !(node && !node->coordinator);
     timer_t timerid;
     struct itimerspec timerspec = {};
 
@@ -272,54 +5718,72 @@ int main(int argc, char **argv)
         timer_event.sigev_signo = TIMER_SIGNAL;
         PERR(timer_create(CLOCK_MONOTONIC, &timer_event, &timerid) < 0, "emu: timer_create");
 
-        timerspec.it_interval = interval;
-        timerspec.it_value = interval;
+        // An adaptive interval is re-armed as a one-shot timer every sample
+        timerspec.it_value = sec_to_timespec(sampler.interval);
+        if (!sampler_dynamic(&sampler))
+            timerspec.it_interval = timerspec.it_value;
 
         if (state_monitoring) {
             PERR(timer_settime(timerid, 0, &timerspec, NULL) < 0, "emu: arm timer");
         }
     }
 
-    void *emu_dummyptr = NULL;
-    long long emu_dummysize = 0;
+    struct reservation reservation = {};
+
+    struct cgroup cgroup;
+    struct cgroup *cg = NULL;
+
+    if (cgroup_parent) {
+        cgroup_create(&cgroup, cgroup_parent);
+        cgroup.page_sizes = emu_page_sizes;
+        cg = &cgroup;
+    }
 
     if (enable_emu) {
-        long long free0;
         // numa_available() && numa_num_task_nodes() > 2
 
         // numa_set_membind(3)
-        
-        numa_run_on_node(0);
+
+        // With a cpuset the target is confined by its cgroup instead, and
+        // emu itself is free to run elsewhere.
+        if (cg && cg->cpuset) {
+            struct bitmask *mems = emu_local_size == 0 ? topology.far : topology.both;
+            cgroup_set_cpuset(cg, mems);
+        } else {
+            numa_run_on_node_mask(topology.local);
+        }
 
         // Fail allocation if requested node is full
         numa_set_strict(1);
 
-        // Fill up local NUMA node to requested size
-        if (rank == 0 && emu_local_size > 0) {
-            numa_node_size(0, &free0);
-            printf("emu: availGB %.2f\n", free0/(float)GB);
-
-            if (free0 > emu_local_size) {
-                emu_dummysize = free0 - emu_local_size;
-                printf("emu: allocatingGB %.2f\n", emu_dummysize/(float)GB);
+        // Fill up the local nodes to requested size
+        if (reserver && emu_local_size > 0) {
+            long long avail = topology_free(0, NULL);
+            printf("emu: availGB %.2f\n", avail/(float)GB);
 
-                emu_dummyptr = numa_alloc_onnode(emu_dummysize, 0);
-                //memset(dummyptr, 0xff, dummysize);
+            if (avail > emu_local_size) {
+                printf("emu: allocatingGB %.2f\n", (avail - emu_local_size)/(float)GB);
 
-                // Fault and prevent swapping
-                PERR(mlock(emu_dummyptr, emu_dummysize) < 0, "emu: mlock, is the memlock rlimit too low?");
-            } else if (free0 < emu_local_size) {
-                fprintf(stderr, "error: only %lld bytes free on node 0\n", free0);
+                reserve_create(&reservation, emu_local_size, emu_hugetlb);
+            } else if (avail < emu_local_size) {
+                fprintf(stderr, "error: only %lld bytes free on the local nodes\n", avail);
                 return 1;
             }
         }
 
-        if (rank == 0) {
-            numa_node_size(0, &free0);
-            printf("emu: availGB %.2f\n", free0/(float)GB);
-        }
+        // Capacity changes resize the reservation, so map it even if empty
+        if (enable_capacity && !reservation.n)
+            reserve_create(&reservation, -1, emu_hugetlb);
+
+        if (reserver)
+            printf("emu: availGB %.2f\n", topology_free(0, NULL)/(float)GB);
     }
 
+    if (node && node->coordinator)
+        node_release(node);
+    else if (node)
+        node_wait(node);
+
     // Start target app
     int target_pipe[2] = {-1, -1};
 
@@ -338,18 +5802,109 @@ int main(int argc, char **argv)
         }
     }
 
+    struct proc_tree proc_tree;
+    struct proc_tree *tree = NULL;
+
+    if (follow_tree) {
+        proc_tree_init(&proc_tree, cg);
+        proc_tree.page_sizes = emu_page_sizes;
+        tree = &proc_tree;
+    }
+
+    struct idle_tracker idle_tracker;
+    struct memprof memprof = {};
+    memprof.tree = tree;
+
+    if (enable_memprof && memprof_idle) {
+        idle_init(&idle_tracker);
+        memprof.idle = &idle_tracker;
+    }
+
+    struct dirty_tracker dirty_tracker;
+    if (enable_memprof && memprof_dirty) {
+        dirty_init(&dirty_tracker);
+        memprof.dirty = &dirty_tracker;
+    }
+
+    struct access_trace access_trace;
+    if (enable_memprof && trace_name) {
+        trace_open(&access_trace, trace_name, rank, memprof.idle);
+        memprof.trace = &access_trace;
+    }
+
+    struct tier tier_state;
+    struct tier *tier = NULL;
+    if (tier_promote) {
+        // Use idle page tracking if the kernel has it
+        if (access(IDLE_BITMAP, W_OK) == 0) {
+            idle_init(&idle_tracker);
+            tier_init(&tier_state, tier_promote, tier_demote, &idle_tracker);
+        } else {
+            tier_init(&tier_state, tier_promote, tier_demote, NULL);
+        }
+        tier = &tier_state;
+    }
+
+    placement_init(&placement);
+
+    struct alloc_sites alloc_state;
+    struct alloc_sites *alloc = NULL;
+    if (alloc_top || placement_needs_preload(&placement)) {
+        alloc_sites_init(&alloc_state, alloc_top);
+        placement_preload(&placement, &alloc_state);
+        alloc = &alloc_state;
+    }
+
+    struct smaps_regions regions;
+    if (enable_memprof && memprof_regions) {
+        regions_init(&regions, memprof_regions);
+        memprof.regions = &regions;
+    }
+
+    struct phase_ring phase_ring = {.fd = -1, .efd = -1};
+    if (enable_phase_ring)
+        phase_ring_init(&phase_ring);
+    else
+        unsetenv(EMUPHASE_ENV);
+
+    // The target waits for its counters to be opened before exec
+    int perf_pipe[2] = {-1, -1};
+    if (enable_perf)
+        PERR(pipe2(perf_pipe, O_CLOEXEC) < 0, "emu: perf pipe");
+
     int pid = fork();
     PERR(pid < 0, "emu: fork");
 
+    if (pid > 0 && node)
+        node_register(node, pid, rank);
+
+    if (pid > 0 && enable_perf) {
+        perf_open(pid);
+        close(perf_pipe[0]);
+        close(perf_pipe[1]);
+    }
+
+    if (tree)
+        tree->target = pid;
+    memprof.pid = pid;
+    if (tier)
+        tier->pid = pid;
+    if (alloc)
+        alloc->pid = pid;
+
     if (pid == 0) {
+        if (cg)
+            cgroup_enter(cg);
+
         if (enable_emu) {
             if (emu_interleave) {
-                numa_set_interleave_mask(numa_all_nodes_ptr);
+                numa_set_interleave_mask(topology.both);
             }
 
-            if (emu_local_size == 0) {
-                struct bitmask *mask = numa_parse_nodestring("1");
-                numa_set_membind(mask);
+            placement_apply(&placement);
+
+            if (emu_local_size == 0 && !(cg && cg->cpuset)) {
+                numa_set_membind(topology.far);
                 /*
             } else if (emu_local_size < 0) {
                 printf("emu: binding to local memory\n");
@@ -366,6 +5921,16 @@ int main(int argc, char **argv)
             close(target_pipe[0]);
         }
 
+        if (enable_perf) {
+            char c;
+            close(perf_pipe[1]);
+            PERR(read(perf_pipe[0], &c, 1) < 0, "emu: wait for perf counters");
+            close(perf_pipe[0]);
+        }
+
+        if (alloc)
+            alloc_sites_preload(alloc);
+
         if (execvp(argv[optind], argv + optind) < 0) { 
             sprintf(tmp, "emu: exec target '%s'", argv[optind]);
             perror(tmp);
@@ -373,8 +5938,11 @@ int main(int argc, char **argv)
         }
     }
 
+    struct numa_maps numa_maps;
+    numa_maps_init(&numa_maps, pid, emu_page_sizes);
+
     int outfd = -1;
-    FILE *outstream = NULL;
+    struct relay relay;
 
     if (monitor_out) {
         close(target_pipe[1]);
@@ -387,8 +5955,7 @@ int main(int argc, char **argv)
         flags = fcntl(outfd, F_SETFL, flags | O_NONBLOCK);
         PERR(flags < 0, "emu: set target stdout non-blocking");
 
-        outstream = fdopen(outfd, "r");
-        PERR(!outstream, "emu: fdopen target stdout");
+        relay_init(&relay, outfd);
     }
 
     // Use epoll to wait for the following events:
@@ -412,86 +5979,133 @@ int main(int argc, char **argv)
     PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ep_event) < 0,
             "emu: add signalfd to epoll");
 
+    if (enable_phase_ring) {
+        ep_event.data.fd = phase_ring.efd;
+        PERR(epoll_ctl(epfd, EPOLL_CTL_ADD, phase_ring.efd, &ep_event) < 0,
+                "emu: add phase eventfd to epoll");
+    }
+
+    struct capacity capacity;
+    if (enable_capacity)
+        capacity_init(&capacity, &reservation, capacity_schedule, capacity_socket, epfd);
+
+    if (metrics_path)
+        metrics_init(&metrics, metrics_path, epfd);
+
+    // Set when the target of a node coordinator exited before other ranks
+    bool target_done = false;
+
     for (;;) {
-        PERR(epoll_wait(epfd, &ep_event, 1, -1) < 0, "emu: epoll_wait");
+        metrics_push(&metrics);
+
+        int nev = epoll_wait(epfd, &ep_event, 1, target_done ? 100 : -1);
+        PERR(nev < 0, "emu: epoll_wait");
+
+        if (target_done && node_others(node) == 0)
+            break;
+        if (nev == 0)
+            continue;
 
         if (ep_event.data.fd == sigfd) {
             struct signalfd_siginfo info;
             PERR(read(sigfd, &info, sizeof(info)) != sizeof(info), "emu: read siginfo failed");
 
             if (info.ssi_signo == SIGCHLD) {
-                if (info.ssi_pid != pid)
-                    continue;
+                // SIGCHLD is not queued, so with -f the one of the target
+                // may have been merged into that of an orphan. Orphans are
+                // reaped and the target polled on every SIGCHLD, whoever
+                // sent it.
+                if (tree)
+                    proc_tree_reap(tree);
 
-                if (info.ssi_code == CLD_CONTINUED)
+                siginfo_t si = {};
+                if (target_done ||
+                        waitid(P_PID, pid, &si, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) < 0 ||
+                        si.si_pid != pid)
                     continue;
-                else if (info.ssi_code == CLD_STOPPED) {
+
+                if (si.si_code == CLD_STOPPED) {
                     printf("emu: stop\n");
 
                     if (enable_memprof) {
                         if (rank == 0) {
-                            memprof_show_stats(pid);
-                            memprof_clear_refs(pid);
+                            memprof_sample(&memprof);
+                            memprof_reset(&memprof);
                         }
                     }
 
                     printf("emu: continue\n");
                     PERR(kill(pid, SIGCONT) < 0, "emu: send SIGCONT");
+                } else if (node && node->coordinator && node_others(node) > 0) {
+                    printf("emu: waiting for %d ranks\n", node_others(node));
+                    node_unregister(node);
+                    target_done = true;
                 } else
                     break;
             } else if (info.ssi_signo == TIMER_SIGNAL) {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+
                 if (enable_emu) {
-                    emu_show_stats(pid);
+                    emu_sample(&numa_maps, cg, tree, node);
                 }
 
+                if (tier)
+                    tier_step(tier);
+
+                if (alloc && alloc->top)
+                    alloc_sites_step(alloc);
+
                 if (enable_memprof) {
                     if (rank == 0) {
-                        memprof_show_stats(pid);
-                        memprof_clear_refs(pid);
+                        memprof_sample(&memprof);
+                        memprof_reset(&memprof);
                     }
                 }
+
+                if (enable_phase_ring && phase_ring_blocked(&phase_ring))
+                    PERR(eventfd_write(phase_ring.efd, 1) < 0, "emu: wake phase ring");
+
+                if (sampler_dynamic(&sampler) && state_monitoring) {
+                    clock_gettime(CLOCK_MONOTONIC, &t1);
+                    timerspec.it_value = sec_to_timespec(sampler_next(&sampler, timespec_diff(&t0, &t1)));
+                    PERR(timer_settime(timerid, 0, &timerspec, NULL) < 0, "emu: arm timer");
+                }
             } else {
                 fprintf(stderr, "emu: unexpected signal %d\n", info.ssi_signo);
             }
         } else if (ep_event.data.fd == outfd) {
-            errno = 0;
-            while (fgets(tmp, sizeof(tmp), outstream)) {
-                printf("%s", tmp);
-
-                // Remove newline for pattern matching
-                for (char *t = tmp; *t; t++) {
-                    if (*t == '\n') {
-                        *t = '\0';
-                        break;
-                    }
-                }
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
 
-                if (!state_monitoring && start_pattern &&
-                        fnmatch(start_pattern, tmp, 0) == 0)
-                {
+            int m;
+            while ((m = relay_next(&relay)) >= 0) {
+                if (!state_monitoring && (m & (1 << MARKER_START))) {
                     state_monitoring = true;
+                    sample_log.phase++;
                     printf("emu: start %.2f\n", get_time());
 
                     if (enable_emu)
-                        emu_show_stats(pid);
+                        emu_sample(&numa_maps, cg, tree, node);
 
-                    if (enable_memprof && rank == 0)
-                        memprof_clear_refs(pid);
+                    if (enable_memprof && rank == 0) {
+                        if (tree)
+                            proc_tree_refresh(tree);
+                        memprof_reset(&memprof);
+                    }
 
                     if (enable_timer) {
                         PERR(timer_settime(timerid, 0, &timerspec, NULL) < 0, "emu: timer_settime");
                     }
-                } else if (state_monitoring && end_pattern &&
-                        fnmatch(end_pattern, tmp, 0) == 0)
-                {
+                } else if (state_monitoring && (m & (1 << MARKER_END))) {
                     if (enable_emu)
-                        emu_show_stats(pid);
+                        emu_sample(&numa_maps, cg, tree, node);
 
                     // If timer is enabled, then printing stats here would be
                     // confusing since the last interval would be shorter
                     // then all the others.
                     if (enable_memprof && rank == 0 && !enable_timer)
-                        memprof_show_stats(pid);
+                        memprof_sample(&memprof);
 
                     if (enable_timer) {
                         struct itimerspec zero = {};
@@ -499,19 +6113,107 @@ int main(int argc, char **argv)
                     }
 
                     state_monitoring = false;
+                    markers_phase(-1, get_time());
                     printf("emu: end %.2f\n", get_time());
                 }
+
+                if (m & (1 << MARKER_PHASE)) {
+                    markers_phase(markers.matched_phase, get_time());
+                    sample_log.phase++;
+                }
             }
 
-            // fgets result
-            PERR(errno && errno != EAGAIN, "emu: read target stdout");
+            if (m == RELAY_EOF)
+                PERR(epoll_ctl(epfd, EPOLL_CTL_DEL, outfd, NULL) < 0,
+                        "emu: remove target stdout from epoll");
+
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            overhead_add(OVERHEAD_RELAY, timespec_diff(&t0, &t1));
+        } else if (enable_phase_ring && ep_event.data.fd == phase_ring.efd) {
+            uint64_t count;
+            PERR(read(phase_ring.efd, &count, sizeof(count)) < 0 && errno != EAGAIN,
+                    "emu: read phase eventfd");
+
+            // Each marker ends the current phase, so its sample is
+            // accounted to that phase before the next one starts. A burst
+            // of markers is sampled once, at its last marker.
+            struct emuphase_entry e;
+            while (phase_ring_next(&phase_ring, &e)) {
+                double latency = phase_ring_latency(&e);
+                double time = get_time() - latency;
+                bool begin = e.kind == EMUPHASE_BEGIN;
+                if (begin)
+                    printf("emu: marker begin name %s latencyus %.1f time %.*f\n",
+                            e.name, 1e6 * latency, time_digits, time);
+                else
+                    printf("emu: marker end latencyus %.1f time %.*f\n",
+                            1e6 * latency, time_digits, time);
+
+                // The last marker often comes right before the target exits
+                siginfo_t si = {};
+                bool exited = waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+                    si.si_pid == pid;
+
+                if (state_monitoring && !exited && !phase_ring_pending(&phase_ring)) {
+                    if (enable_emu)
+                        emu_sample(&numa_maps, cg, tree, node);
+
+                    if (enable_memprof && rank == 0) {
+                        memprof_sample(&memprof);
+                        memprof_reset(&memprof);
+                    }
+                }
+
+                markers_phase(begin ? markers_phase_find(e.name) : -1, time);
+                if (begin)
+                    sample_log.phase++;
+            }
+        } else if (enable_capacity && capacity_handle(&capacity, ep_event.data.fd, epfd)) {
+            continue;
+        } else if (metrics_handle(&metrics, ep_event.data.fd, epfd)) {
+            continue;
         } else {
             fprintf(stderr, "emu: unexpected epoll_wait fd %d\n", ep_event.data.fd);
             exit(EXIT_FAILURE);
         }
     }
 
-    if (emu_dummyptr) {
-        numa_free(emu_dummyptr, emu_dummysize);
+    if (tier)
+        tier_summary(tier);
+
+    if (alloc)
+        alloc_sites_destroy(alloc);
+
+    if (placement.mode)
+        placement_summary(&placement);
+
+    // Output the target wrote just before it exited
+    if (monitor_out) {
+        while (relay_next(&relay) >= 0)
+            ;
+        relay_destroy(&relay);
     }
+
+    if (enable_phase_ring)
+        phase_ring_destroy(&phase_ring);
+    metrics_push(&metrics);
+    metrics_destroy(&metrics);
+    if (memprof.trace)
+        trace_close(memprof.trace);
+    markers_summary();
+    overhead_summary();
+    perf_close();
+
+    if (enable_capacity)
+        capacity_destroy(&capacity);
+
+    if (node)
+        node_detach(node);
+
+    reserve_destroy(&reservation);
+
+    if (cg)
+        cgroup_destroy(cg);
+
+    sample_log_close();
 }
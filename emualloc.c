@@ -0,0 +1,388 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// libemualloc: preloaded by emu -A or -X into the target. Large allocations
+// by malloc, calloc, realloc, the aligned allocators and anonymous mmap are
+// recorded with a hash of their call stack, and so are frees of such
+// allocations, or bound to nodes with mbind(). Smaller allocations only pay
+// for a comparison of the size, and frees for a malloc_usable_size(), so hot
+// allocator paths stay fast. The glibc allocator is called through its
+// __libc_ entry points, which need no lookup and don't come back here.
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <execinfo.h>
+#include <link.h>
+#include <numaif.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "emualloc.h"
+
+#ifndef MPOL_PREFERRED_MANY
+#define MPOL_PREFERRED_MANY 5
+#endif
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
+extern int __munmap(void *addr, size_t len);
+
+// Frames of this library on top of the stack, which are not part of a site
+#define MAX_FRAMES (EMUALLOC_DEPTH + 8)
+
+static struct emualloc_shm *shm;
+// Smallest allocation recorded or placed, nothing before the ring is attached
+static size_t min_size = SIZE_MAX;
+static size_t record_size = SIZE_MAX, place_size = SIZE_MAX;
+static long pagesize;
+// Code of this library
+static uintptr_t text_start, text_end;
+
+static __thread struct emualloc_thread *self;
+// Releases the ring of a thread when it exits
+static pthread_key_t self_key;
+// Set while recording, backtrace() may allocate
+static __thread bool busy;
+
+// A child of fork has its own address space, its allocations don't count
+static void detach_child(void)
+{
+    min_size = record_size = place_size = SIZE_MAX;
+    shm = NULL;
+    self = NULL;
+}
+
+// Records of the ring not read yet are read after the next owner's, which
+// keeps counting from the same head
+static void release_slot(void *slot)
+{
+    struct emualloc_thread *t = slot;
+    self = NULL;
+    if (shm)
+        __atomic_store_n(&t->used, 0, __ATOMIC_RELEASE);
+}
+
+// The first free ring, NULL if all are taken
+static struct emualloc_thread *claim_slot(void)
+{
+    for (uint32_t i = 0; i < EMUALLOC_THREADS; i++) {
+        struct emualloc_thread *t = &shm->thread[i];
+        uint32_t used = __atomic_load_n(&t->used, __ATOMIC_RELAXED);
+        if (used || !__atomic_compare_exchange_n(&t->used, &used, 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        uint32_t n = __atomic_load_n(&shm->nthreads, __ATOMIC_RELAXED);
+        while (n <= i && !__atomic_compare_exchange_n(&shm->nthreads, &n, i + 1, false,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        pthread_setspecific(self_key, t);
+        return t;
+    }
+    return NULL;
+}
+
+static int find_text(struct dl_phdr_info *info, size_t size, void *data)
+{
+    uintptr_t self = (uintptr_t)data;
+    (void)size;
+
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        if (ph->p_type == PT_LOAD && self >= start && self < start + ph->p_memsz) {
+            text_start = start;
+            text_end = start + ph->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+__attribute__((constructor))
+static void attach(void)
+{
+    const char *env = getenv(EMUALLOC_ENV);
+    if (!env)
+        return;
+
+    struct emualloc_shm *s = __mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+            MAP_SHARED, atoi(env), 0);
+    if (s == MAP_FAILED)
+        return;
+    if (s->magic != EMUALLOC_MAGIC || s->pid != getpid()) {
+        __munmap(s, sizeof(*s));
+        return;
+    }
+
+    // The unwinder is loaded, and allocates, on first use
+    void *pc[1];
+    busy = true;
+    backtrace(pc, 1);
+    dl_iterate_phdr(find_text, (void *)attach);
+    busy = false;
+
+    pthread_atfork(NULL, NULL, detach_child);
+    if (pthread_key_create(&self_key, release_slot) != 0) {
+        __munmap(s, sizeof(*s));
+        return;
+    }
+    shm = s;
+    pagesize = sysconf(_SC_PAGESIZE);
+    if (s->record_size)
+        record_size = s->record_size;
+    if (s->place != EMUALLOC_PLACE_NONE && s->place_size) {
+        place_size = s->place_size;
+        // Placed allocations get mappings of their own, so a policy never
+        // covers heap memory that is reused by smaller allocations after
+        // the free. Above the largest threshold glibc mmaps anyway.
+        mallopt(M_MMAP_THRESHOLD, place_size);
+    }
+    min_size = record_size < place_size ? record_size : place_size;
+}
+
+// Prefer the nodes of a side for the whole pages in [start, end). Preferred
+// rather than bound, so a full node spills over instead of failing the
+// allocation. Pages already touched, by calloc() or the copy of realloc(),
+// are moved. Several nodes need MPOL_PREFERRED_MANY (5.15), before that
+// only the first one is preferred.
+static void place_range(uintptr_t start, uintptr_t end, int side)
+{
+    unsigned long mask = shm->nodes[side];
+    if (end <= start || !mask)
+        return;
+
+    if (!(mask & (mask - 1)) || syscall(SYS_mbind, start, end - start,
+                MPOL_PREFERRED_MANY, &mask, sizeof(mask) * 8, MPOL_MF_MOVE) < 0) {
+        mask &= -mask;
+        syscall(SYS_mbind, start, end - start, MPOL_PREFERRED,
+                &mask, sizeof(mask) * 8, MPOL_MF_MOVE);
+    }
+}
+
+// Stripes are aligned multiples of 2 MB, so huge pages are not split, and
+// grow with the allocation to keep at most MAX_STRIPES per allocation.
+// Stripes are numbered across allocations, so that small allocations
+// alternate too, and stripe i goes local if the running share of local
+// stripes, i * weight[0] / (weight[0] + weight[1]), passes an integer at
+// i, so local and far stripes alternate as evenly as the weights allow.
+#define STRIPE_MIN (2UL << 20)
+#define MAX_STRIPES 256
+
+static uint64_t stripes;
+
+static int stripe_side(uint64_t i)
+{
+    uint64_t w0 = shm->weight[0], total = shm->weight[0] + shm->weight[1];
+    return (i + 1) * w0 / total > i * w0 / total ? 0 : 1;
+}
+
+static void place(void *addr, size_t size)
+{
+    uintptr_t start = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = ((uintptr_t)addr + size) & ~(pagesize - 1);
+    if (end <= start)
+        return;
+
+    if (shm->place == EMUALLOC_PLACE_REMOTE) {
+        place_range(start, end, 1);
+        return;
+    }
+
+    uintptr_t stripe = STRIPE_MIN;
+    while ((end - start) / stripe > MAX_STRIPES)
+        stripe *= 2;
+    uintptr_t first = start & ~(stripe - 1);
+    uint64_t n = (end - 1 - first) / stripe + 1;
+    uint64_t base = __atomic_fetch_add(&stripes, n, __ATOMIC_RELAXED);
+
+    // Adjacent stripes on the same side are bound with one call
+    uintptr_t run = start;
+    int side = stripe_side(base);
+    for (uint64_t i = 1; i < n; i++) {
+        int next = stripe_side(base + i);
+        if (next != side) {
+            place_range(run, first + i * stripe, side);
+            run = first + i * stripe;
+            side = next;
+        }
+    }
+    place_range(run, end, side);
+}
+
+static uint32_t site_find(void)
+{
+    void *pc[MAX_FRAMES];
+    int n = backtrace(pc, MAX_FRAMES);
+    int skip = 0;
+    while (skip < n && (uintptr_t)pc[skip] >= text_start && (uintptr_t)pc[skip] < text_end)
+        skip++;
+    int depth = n - skip < EMUALLOC_DEPTH ? n - skip : EMUALLOC_DEPTH;
+
+    // FNV-1a over the return addresses
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < depth; i++) {
+        uint64_t x = (uintptr_t)pc[skip + i];
+        for (int b = 0; b < 8; b++, x >>= 8)
+            hash = (hash ^ (x & 0xff)) * 1099511628211ULL;
+    }
+    if (!hash)
+        hash = 1;
+
+    uint32_t idx = hash % EMUALLOC_SITES;
+    for (int i = 0; i < EMUALLOC_SITES; i++, idx = (idx + 1) % EMUALLOC_SITES) {
+        struct emualloc_site *s = &shm->site[idx];
+        uint64_t cur = __atomic_load_n(&s->hash, __ATOMIC_ACQUIRE);
+
+        if (!cur && __atomic_compare_exchange_n(&s->hash, &cur, hash, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            for (int j = 0; j < depth; j++)
+                s->pc[j] = (uintptr_t)pc[skip + j];
+            __atomic_store_n(&s->depth, depth, __ATOMIC_RELEASE);
+            return idx;
+        }
+        if (cur == hash)
+            return idx;
+    }
+    return EMUALLOC_NO_SITE;
+}
+
+// Append an allocation, or a free if size is 0, to the ring of this thread
+static void record(void *addr, size_t size, uint32_t flags)
+{
+    if (busy || !shm)
+        return;
+    busy = true;
+
+    if (!self)
+        self = claim_slot();
+
+    uint64_t head = self ? self->head : 0;
+    if (!self || head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) == EMUALLOC_RECORDS) {
+        __atomic_fetch_add(&shm->dropped, 1, __ATOMIC_RELAXED);
+    } else {
+        struct emualloc_record *r = &self->record[head % EMUALLOC_RECORDS];
+        r->addr = (uintptr_t)addr;
+        r->size = size;
+        r->site = size && !flags ? site_find() : EMUALLOC_NO_SITE;
+        r->flags = flags;
+        r->seq = __atomic_fetch_add(&shm->seq, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    busy = false;
+}
+
+// A new allocation of at least min_size bytes
+static void allocated(void *addr, size_t size)
+{
+    if (size >= place_size)
+        place(addr, size);
+    if (size >= record_size)
+        record(addr, size, 0);
+}
+
+// Frees are recorded before the memory can be reused, so that they are
+// ordered before a later allocation at the same address
+static inline bool recorded(void *ptr)
+{
+    return __builtin_expect(record_size != SIZE_MAX, 0) && ptr && malloc_usable_size(ptr) >= record_size;
+}
+
+static inline void record_free(void *ptr)
+{
+    if (recorded(ptr))
+        record(ptr, 0, 0);
+}
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+    if (__builtin_expect(size >= min_size, 0) && p)
+        allocated(p, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+    size_t total;
+    if (!__builtin_mul_overflow(n, size, &total) && __builtin_expect(total >= min_size, 0) && p)
+        allocated(p, total);
+    return p;
+}
+
+// A failed realloc() leaves the allocation alone, so it is recorded again,
+// with its usable size. realloc(ptr, 0) returns NULL after freeing.
+void *realloc(void *ptr, size_t size)
+{
+    size_t old = recorded(ptr) ? malloc_usable_size(ptr) : 0;
+    if (old)
+        record(ptr, 0, 0);
+    void *p = __libc_realloc(ptr, size);
+    if (old && !p && size)
+        record(ptr, old, 0);
+    if (__builtin_expect(size >= min_size, 0) && p)
+        allocated(p, size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    record_free(ptr);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+    if (__builtin_expect(size >= min_size, 0) && p)
+        allocated(p, size);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+    if (__builtin_expect(size >= min_size, 0) && p)
+        allocated(p, size);
+    return p;
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+
+    void *p = __libc_memalign(align, size);
+    if (!p)
+        return ENOMEM;
+    if (__builtin_expect(size >= min_size, 0))
+        allocated(p, size);
+    *ptr = p;
+    return 0;
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    void *p = __mmap(addr, len, prot, flags, fd, off);
+    if (__builtin_expect(len >= min_size, 0) && p != MAP_FAILED && (flags & MAP_ANONYMOUS))
+        allocated(p, len);
+    return p;
+}
+
+int munmap(void *addr, size_t len)
+{
+    if (__builtin_expect(record_size != SIZE_MAX, 0) && len)
+        record(addr, len, EMUALLOC_UNMAP);
+    return __munmap(addr, len);
+}
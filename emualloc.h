@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// Shared memory layout between emu and libemualloc.so, which emu preloads
+// into the target to record large allocations with their call sites (-A)
+// and to place large allocations on nodes (-X). Each thread of the target
+// gets its own ring of records, written only by that thread and read by emu
+// every interval, and handed to a later thread when it exits. Call sites
+// are kept in a hash table keyed by a hash of the call stack. EMUALLOC_ENV
+// holds the memfd.
+#ifndef EMUALLOC_H
+#define EMUALLOC_H
+
+#include <stdint.h>
+
+#define EMUALLOC_ENV "EMU_ALLOC_FD"
+#define EMUALLOC_MAGIC 0x454d55414c4c4f43ULL
+#define EMUALLOC_THREADS 256
+#define EMUALLOC_RECORDS 4096
+#define EMUALLOC_SITES 4096
+#define EMUALLOC_DEPTH 6
+#define EMUALLOC_NO_SITE UINT32_MAX
+
+// Placement of allocations of at least place_size bytes, on the local
+// (nodes[0]) and far (nodes[1]) node masks
+#define EMUALLOC_PLACE_NONE     0
+// Stripes of the range, weight[0] of every weight[0] + weight[1] local
+#define EMUALLOC_PLACE_STRIPE   1
+#define EMUALLOC_PLACE_REMOTE   2
+
+// An munmap of size bytes at addr, which may cover only part of an
+// allocation, or several
+#define EMUALLOC_UNMAP 1
+
+// A free has size 0. Records of all threads are ordered by seq.
+struct emualloc_record {
+    uint64_t addr;
+    uint64_t size;
+    uint64_t seq;
+    uint32_t site;
+    uint32_t flags;
+};
+
+// Written by its thread up to head, read by emu up to tail. Owned by a
+// thread while used is set.
+struct emualloc_thread {
+    uint64_t head;
+    uint32_t used;
+    uint8_t reserved[52];
+    uint64_t tail;
+    uint8_t reserved2[56];
+    struct emualloc_record record[EMUALLOC_RECORDS];
+};
+
+// Claimed by setting hash, valid once depth is set
+struct emualloc_site {
+    uint64_t hash;
+    uint32_t depth;
+    uint32_t reserved;
+    uint64_t pc[EMUALLOC_DEPTH];
+};
+
+struct emualloc_shm {
+    uint64_t magic;
+    // Only the process with this pid records, not those it starts
+    int32_t pid;
+    // Rings ever used, emu reads the first nthreads
+    uint32_t nthreads;
+    // Smallest allocation recorded or placed, 0 for none
+    uint64_t record_size, place_size;
+    uint32_t place;
+    uint32_t weight[2];
+    uint32_t reserved;
+    uint64_t nodes[2];
+    uint64_t seq;
+    uint64_t dropped;
+    struct emualloc_site site[EMUALLOC_SITES];
+    struct emualloc_thread thread[EMUALLOC_THREADS];
+};
+
+#ifndef __cplusplus
+_Static_assert(sizeof(struct emualloc_record) == 32, "emualloc record size");
+_Static_assert(sizeof(struct emualloc_site) == 64, "emualloc site size");
+#endif
+
+#endif
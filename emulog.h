@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// Binary sample log, written by emu -o and read by agg. A file is a header
+// followed by fixed-size records appended as samples are taken, so a reader
+// can mmap it and index records directly. Fields are in host byte order.
+#ifndef EMULOG_H
+#define EMULOG_H
+
+#include <stdint.h>
+
+#define EMULOG_MAGIC "EMULOG\0"
+#define EMULOG_VERSION 1
+
+struct emulog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    int32_t rank;
+    uint32_t page_size;
+    // CLOCK_REALTIME of emu start, record times are relative to it
+    double start;
+    uint8_t reserved[32];
+};
+
+// Which fields of a record are valid
+#define EMULOG_NODES   0x1
+#define EMULOG_MEMPROF 0x2
+
+struct emulog_record {
+    double time;
+    int32_t rank;
+    // Number of start and phase pattern matches so far
+    uint32_t phase;
+    uint32_t flags;
+    uint32_t reserved;
+    // Pages of header.page_size bytes on the local and far nodes
+    uint64_t node_pages[2];
+    uint64_t rss_kb, pss_kb, ref_kb, anon_kb;
+};
+
+_Static_assert(sizeof(struct emulog_header) == 64, "emulog header size");
+_Static_assert(sizeof(struct emulog_record) == 72, "emulog record size");
+
+#endif
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// Phase markers for applications run under emu. Link with -lemuphase or
+// preload libemuphase.so, and call emu_phase_begin("solve") when a phase
+// starts and emu_phase_end() when it ends. emu samples at every marker and
+// keeps per-phase statistics. Outside of emu the calls do nothing.
+//
+// The markers are passed in a ring in shared memory that emu creates and
+// the target inherits: EMUPHASE_ENV holds the memfd of the ring and an
+// eventfd that is signaled after each marker.
+#ifndef EMUPHASE_H
+#define EMUPHASE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void emu_phase_begin(const char *name);
+void emu_phase_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define EMUPHASE_ENV "EMU_PHASE_FDS"
+#define EMUPHASE_MAGIC 0x454d555048415345ULL
+#define EMUPHASE_SLOTS 256
+#define EMUPHASE_NAME 40
+
+#define EMUPHASE_BEGIN 1
+#define EMUPHASE_END   2
+
+// A slot is published by storing seq = index + 1 after the rest is written
+struct emuphase_entry {
+    uint64_t seq;
+    // CLOCK_MONOTONIC in ns
+    uint64_t time;
+    uint32_t kind;
+    int32_t tid;
+    char name[EMUPHASE_NAME];
+};
+
+// Writers claim slots by advancing head, emu advances tail after reading.
+// Markers are dropped and counted while the ring is full.
+struct emuphase_ring {
+    uint64_t magic;
+    uint64_t head;
+    uint64_t dropped;
+    uint8_t reserved[40];
+    uint64_t tail;
+    uint8_t reserved2[56];
+    struct emuphase_entry entry[EMUPHASE_SLOTS];
+};
+
+#ifndef __cplusplus
+_Static_assert(sizeof(struct emuphase_entry) == 64, "emuphase entry size");
+_Static_assert(sizeof(struct emuphase_ring) == 128 + 64 * EMUPHASE_SLOTS, "emuphase ring size");
+#endif
+
+#endif
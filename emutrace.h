@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// Page access trace, written by emu -m -D and read by whatif. A file is a
+// header followed by one epoch per memprof sample, each a fixed-size record
+// and three lists of pages: those unmapped since the previous epoch, those
+// mapped since, and those referenced since. Pages are virtual page numbers
+// of the target in ascending order, stored as runs of consecutive pages:
+// for each run, the gap from the end of the previous run of the list and
+// the length minus one, both as LEB128 varints. An epoch is appended with a
+// single write, so a reader can stop at the first incomplete one. Fields
+// are in host byte order.
+#ifndef EMUTRACE_H
+#define EMUTRACE_H
+
+#include <stdint.h>
+
+#define EMUTRACE_MAGIC "EMUTRAC"
+#define EMUTRACE_VERSION 1
+
+// Where referenced bits come from
+#define EMUTRACE_IDLE  0 // idle page tracking, reads and writes
+#define EMUTRACE_DIRTY 1 // soft-dirty bits, writes only
+
+struct emutrace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    int32_t rank;
+    uint32_t source;
+    // CLOCK_REALTIME of emu start, epoch times are relative to it
+    double start;
+    uint8_t reserved[32];
+};
+
+// Lists of an epoch, in file order
+enum emutrace_list {
+    EMUTRACE_UNMAPPED,
+    EMUTRACE_MAPPED,
+    EMUTRACE_REFERENCED,
+    EMUTRACE_LISTS,
+};
+
+struct emutrace_epoch {
+    double time;
+    // Bytes of runs following the record
+    uint32_t size;
+    uint32_t runs[EMUTRACE_LISTS];
+};
+
+_Static_assert(sizeof(struct emutrace_header) == 64, "emutrace header size");
+_Static_assert(sizeof(struct emutrace_epoch) == 24, "emutrace epoch size");
+
+#endif
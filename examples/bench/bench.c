@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+// Memory microbenchmarks to calibrate the emulator: pointer chasing latency,
+// STREAM bandwidth and random access (GUPS). Memory placement is left to the
+// caller, run it under emu (node 0), emu -l 0 (node 1) or emu -i
+// (interleaved). Results are printed one per line as "bench: key value ...".
+// The relay kernel instead measures how fast lines written to stdout are
+// consumed, to compare emu's output relay with writing directly.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define KB 1024
+#define MB (1024*1024)
+
+#define PERR(cond, msg) do {if (cond) {perror(msg); exit(EXIT_FAILURE);}} while (0)
+
+#define LINE 64
+#define NTIMES 5
+#define RELAY_LINE 128
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void *alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PERR(p == MAP_FAILED, "bench: mmap");
+    return p;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+// Pointer chasing over one cache line per element, in a random cyclic order
+// so that every load misses and depends on the previous one.
+static void bench_latency(size_t size)
+{
+    size_t n = size / LINE;
+    char *buf = alloc(n * LINE);
+    size_t *order = malloc(n * sizeof(size_t));
+    PERR(!order, "bench: latency order");
+
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = xorshift(&seed) % (i + 1);
+        size_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (size_t i = 0; i < n; i++)
+        *(void **)(buf + order[i] * LINE) = buf + order[(i + 1) % n] * LINE;
+    free(order);
+
+    size_t loads = n < 16*MB ? 16*MB : n;
+    void **p = (void **)buf;
+
+    // Warm up the TLB and caches that can hold part of the buffer
+    for (size_t i = 0; i < n; i++)
+        p = *p;
+
+    double t0 = now();
+    for (size_t i = 0; i < loads; i++)
+        p = *p;
+    double t = now() - t0;
+
+    // Keep the chain live
+    if (p == NULL)
+        printf("\n");
+
+    printf("bench: kernel latency threads 1 sizeMB %zu nsperload %.2f\n",
+            size / MB, 1e9 * t / loads);
+    munmap(buf, n * LINE);
+}
+
+// Threads of the bandwidth kernels, each working on its own slice and
+// synchronized per repetition with a barrier.
+struct worker {
+    pthread_t thread;
+    int id, nthreads;
+    void (*fn)(struct worker *w);
+    double *a, *b, *c;
+    uint64_t *table;
+    size_t n;
+    size_t updates;
+    double best[4];
+};
+
+static pthread_barrier_t barrier;
+
+static void slice(const struct worker *w, size_t n, size_t *start, size_t *end)
+{
+    *start = n * w->id / w->nthreads;
+    *end = n * (w->id + 1) / w->nthreads;
+}
+
+static void stream_kernels(struct worker *w)
+{
+    size_t s, e;
+    slice(w, w->n, &s, &e);
+    double *a = w->a, *b = w->b, *c = w->c;
+    const double q = 3.0;
+
+    // First touch in the same slices as the kernels
+    for (size_t i = s; i < e; i++) {
+        a[i] = 1.0;
+        b[i] = 2.0;
+        c[i] = 0.0;
+    }
+
+    for (int k = 0; k < 4; k++)
+        w->best[k] = 1e30;
+
+    for (int r = 0; r < NTIMES; r++) {
+        double t[4];
+        for (int k = 0; k < 4; k++) {
+            pthread_barrier_wait(&barrier);
+            double t0 = now();
+            switch (k) {
+            case 0:
+                for (size_t i = s; i < e; i++)
+                    c[i] = a[i];
+                break;
+            case 1:
+                for (size_t i = s; i < e; i++)
+                    b[i] = q * c[i];
+                break;
+            case 2:
+                for (size_t i = s; i < e; i++)
+                    c[i] = a[i] + b[i];
+                break;
+            case 3:
+                for (size_t i = s; i < e; i++)
+                    a[i] = b[i] + q * c[i];
+                break;
+            }
+            pthread_barrier_wait(&barrier);
+            t[k] = now() - t0;
+        }
+        for (int k = 0; k < 4; k++) {
+            if (t[k] < w->best[k])
+                w->best[k] = t[k];
+        }
+    }
+}
+
+// Random read-modify-write of 64-bit words, updates are not atomic like in
+// the HPCC RandomAccess benchmark.
+static void gups_kernel(struct worker *w)
+{
+    size_t s, e;
+    slice(w, w->n, &s, &e);
+    uint64_t *table = w->table;
+    uint64_t mask = w->n - 1;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+
+    for (size_t i = s; i < e; i++)
+        table[i] = i;
+
+    pthread_barrier_wait(&barrier);
+    double t0 = now();
+    for (size_t i = 0; i < w->updates; i++) {
+        uint64_t r = xorshift(&seed);
+        table[r & mask] ^= r;
+    }
+    pthread_barrier_wait(&barrier);
+    w->best[0] = now() - t0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    w->fn(w);
+    return NULL;
+}
+
+static void run_workers(struct worker *workers, int nthreads)
+{
+    PERR((errno = pthread_barrier_init(&barrier, NULL, nthreads)), "bench: barrier");
+    for (int i = 0; i < nthreads; i++) {
+        errno = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        PERR(errno, "bench: start worker");
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+}
+
+static void bench_stream(size_t size, int nthreads)
+{
+    static const char *names[] = {"copy", "scale", "add", "triad"};
+    static const int arrays[] = {2, 2, 3, 3};
+
+    size_t n = size / 3 / sizeof(double);
+    double *a = alloc(n * sizeof(double));
+    double *b = alloc(n * sizeof(double));
+    double *c = alloc(n * sizeof(double));
+
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    PERR(!workers, "bench: workers");
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (struct worker){
+            .id = i, .nthreads = nthreads, .fn = stream_kernels,
+            .a = a, .b = b, .c = c, .n = n,
+        };
+    }
+    run_workers(workers, nthreads);
+
+    // All threads time the same barriers, the first one is as good as any
+    for (int k = 0; k < 4; k++) {
+        double bytes = (double)arrays[k] * n * sizeof(double);
+        printf("bench: kernel %s threads %d sizeMB %zu GBps %.2f\n",
+                names[k], nthreads, size / MB, bytes / workers[0].best[k] / 1e9);
+    }
+
+    free(workers);
+    munmap(a, n * sizeof(double));
+    munmap(b, n * sizeof(double));
+    munmap(c, n * sizeof(double));
+}
+
+static void bench_gups(size_t size, int nthreads)
+{
+    // Power of two number of words
+    size_t n = 1;
+    while (2 * n * sizeof(uint64_t) <= size)
+        n *= 2;
+    uint64_t *table = alloc(n * sizeof(uint64_t));
+    size_t updates = 4 * n;
+
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    PERR(!workers, "bench: workers");
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (struct worker){
+            .id = i, .nthreads = nthreads, .fn = gups_kernel,
+            .table = table, .n = n, .updates = updates / nthreads,
+        };
+    }
+    run_workers(workers, nthreads);
+
+    printf("bench: kernel gups threads %d sizeMB %zu GUPS %.4f\n",
+            nthreads, n * sizeof(uint64_t) / MB,
+            (double)(updates / nthreads * nthreads) / workers[0].best[0] / 1e9);
+
+    free(workers);
+    munmap(table, n * sizeof(uint64_t));
+}
+
+// Write size bytes of output lines to stdout in large writes. The result
+// goes to stderr, so stdout can be discarded.
+static void bench_relay(size_t size)
+{
+    size_t bufsize = 64*KB;
+    char *buf = malloc(bufsize);
+    PERR(!buf, "bench: relay buffer");
+    for (size_t i = 0; i < bufsize; i++)
+        buf[i] = i % RELAY_LINE == RELAY_LINE - 1 ? '\n' : 'a' + i % 26;
+
+    double t = now();
+    for (size_t done = 0; done < size; ) {
+        size_t len = size - done < bufsize ? size - done : bufsize;
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        PERR(n < 0, "bench: relay write");
+        done += n;
+    }
+    t = now() - t;
+
+    fprintf(stderr, "bench: kernel relay threads 1 sizeMB %zu linebytes %d MBps %.1f\n",
+            size / MB, RELAY_LINE, size / t / MB);
+    free(buf);
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-s sizeMB] [-t threads,...] [latency] [stream] [gups] [relay]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 1024*MB;
+    int threads[64];
+    int nthreads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoull(optarg, NULL, 10) * MB;
+            break;
+        case 't':
+            for (char *p = strtok(optarg, ","); p && nthreads < 64; p = strtok(NULL, ","))
+                threads[nthreads++] = atoi(p);
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (size < MB) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Powers of two up to the CPUs we may run on
+    if (!nthreads) {
+        cpu_set_t set;
+        int ncpus = sched_getaffinity(0, sizeof(set), &set) == 0 ?
+            CPU_COUNT(&set) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        for (int t = 1; t < ncpus && nthreads < 63; t *= 2)
+            threads[nthreads++] = t;
+        threads[nthreads++] = ncpus;
+    }
+
+    bool latency = optind == argc, stream = latency, gups = latency, relay = false;
+    for (int i = optind; i < argc; i++) {
+        if (strcmp(argv[i], "latency") == 0) {
+            latency = true;
+        } else if (strcmp(argv[i], "stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "gups") == 0) {
+            gups = true;
+        } else if (strcmp(argv[i], "relay") == 0) {
+            relay = true;
+        } else {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (latency)
+        bench_latency(size);
+    for (int t = 0; stream && t < nthreads; t++)
+        bench_stream(size, threads[t]);
+    for (int t = 0; gups && t < nthreads; t++)
+        bench_gups(size, threads[t]);
+    if (relay)
+        bench_relay(size);
+}
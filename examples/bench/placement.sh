@@ -0,0 +1,23 @@
+#!/bin/bash -e
+
+# Sweep the placement policies with the bandwidth benchmarks, and print one
+# line per result with the policy as the first column, followed by the
+# split emu achieved. BENCH_ARGS are passed to bench, e.g.
+# BENCH_ARGS="-s 4096 -t 14 stream".
+
+cd "${BASH_SOURCE%/*}"
+
+run() {
+	local policy=$1
+	shift
+	../../emu "$@" ./bench ${BENCH_ARGS:-stream gups} |
+		sed -n "s/^bench: /bench: policy $policy /p; s/^emu: placement /emu: policy $policy /p"
+}
+
+run local
+run remote -l 0
+run interleave -i
+run preferred -X preferred
+for w in 4:1 3:1 2:1 1:1 1:2; do
+	run weighted:$w -X weighted:$w
+done
@@ -0,0 +1,17 @@
+#!/bin/bash -e
+
+# Throughput of emu's relay of the target output, compared with the same
+# output written directly to a pipe. The output is discarded, the pattern
+# never matches. BENCH_ARGS are passed to bench, e.g. BENCH_ARGS="-s 4096".
+
+cd "${BASH_SOURCE%/*}"
+
+run() {
+	local mode=$1
+	shift
+	{ "$@" ./bench ${BENCH_ARGS:--s 1024} relay | cat >/dev/null; } 2>&1 |
+		sed -n "s/^bench: /bench: mode $mode /p"
+}
+
+run direct
+run relay ../../emu -t 0 -E '*no match*'
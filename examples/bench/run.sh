@@ -0,0 +1,17 @@
+#!/bin/bash -e
+
+# Run the microbenchmarks with memory on node 0, on node 1 and interleaved,
+# and print one line per result with the placement as the first column.
+# BENCH_ARGS are passed to bench, e.g. BENCH_ARGS="-s 4096 -t 1,14 stream".
+
+cd "${BASH_SOURCE%/*}"
+
+run() {
+	local mode=$1
+	shift
+	../../emu -t 0 "$@" ./bench $BENCH_ARGS | sed -n "s/^bench: /bench: mode $mode /p"
+}
+
+run local
+run remote -l 0
+run interleave -i
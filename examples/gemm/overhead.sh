@@ -9,6 +9,8 @@ export OMP_NUM_THREADS=14
 # Memory profiling
 ../emu -m -t 0 ./gemm 20000
 ../emu -m -t 1 ./gemm 20000
+../emu -m -I -t 1 ./gemm 20000
+../emu -m -O -t 100ms ./gemm 20000
 
 # Numactl
 numactl -N 0 -m 0 ./gemm 20000
@@ -17,3 +19,4 @@ numactl -N 0 -m 1 ./gemm 20000
 # Emulator
 ../emu -t 1 ./gemm 20000
 ../emu -l 0 -t 1 ./gemm 20000
+../emu -O -t 100ms ./gemm 20000
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+PROG="./gemm 20000"
+
+set -x
+export OMP_NUM_THREADS=14
+
+# Local memory first, remote when full
+../emu -X preferred $PROG
+
+# Weighted interleave, local:remote
+for w in 4:1 3:1 2:1 1:1 1:2; do
+	../emu -X weighted:$w $PROG
+done
+
+# Only buffers of 1 GB and more remote
+../emu -X size:1g $PROG
@@ -0,0 +1,12 @@
+#!/bin/bash
+
+PROG="./gemm 20000"
+
+set -x
+export OMP_NUM_THREADS=14
+
+# One profiling run with a page access trace
+../emu -m -I -D gemm.trace $PROG
+
+# 25%, 50%, 75% local memory, as in sensitivity.sh
+../whatif -l 2.6575g,4.905g,7.1525g -p first,interleave,ideal gemm.trace
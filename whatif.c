@@ -0,0 +1,524 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emutrace.h"
+
+#define KB 1024
+#define MB (1024*1024)
+#define GB (1024*1024*1024)
+
+// Replays a page access trace (emu -m -D) against a local memory capacity
+// and a placement policy, to predict the fraction of referenced pages that
+// are local in each epoch without running the target again. Referenced
+// pages stand in for accesses, so a page counts once per epoch however
+// often it was touched, and pages mapped in the same epoch are placed in
+// address order rather than in the order they were faulted in.
+enum policy_kind {
+    POLICY_FIRST,
+    POLICY_WEIGHTED,
+    POLICY_IDEAL,
+};
+
+// Bitmap of the pages placed on the local nodes, allocated in chunks as
+// the address space is touched. Chunks are found in an open addressing
+// table keyed by page number / CHUNK_PAGES.
+#define CHUNK_SHIFT 15
+#define CHUNK_PAGES (1UL << CHUNK_SHIFT)
+#define CHUNK_WORDS (CHUNK_PAGES / 64)
+
+struct bitmap {
+    uint64_t *keys;
+    uint64_t **bits;
+    size_t n, size;
+};
+
+struct sim {
+    const char *name;
+    enum policy_kind kind;
+    int weight[2];
+    uint64_t capacity;
+    struct bitmap local_pages;
+    // Pages mapped on each side, and position in the interleave cycle
+    uint64_t local, remote;
+    int pos;
+    // Referenced pages, all and local, of the epoch and of the run
+    uint64_t ref, hits;
+    uint64_t total_ref, total_hits;
+    uint64_t max_local, max_remote;
+};
+
+struct runs {
+    uint64_t *start, *len;
+    size_t n, max;
+};
+
+struct trace {
+    const char *name;
+    const struct emutrace_header *header;
+    const uint8_t *end;
+};
+
+bool parse_size(const char *s, long long *size)
+{
+    char *end = NULL;
+    double v = strtod(s, &end);
+
+    if (end == s)
+        return false;
+
+    switch (tolower(*end)) {
+    case 'g':
+        *size = v * GB;
+        break;
+    case 'm':
+        *size = v * MB;
+        break;
+    case 'k':
+        *size = v * KB;
+        break;
+    case '\0':
+    case '\n':
+        *size = v;
+        return true;
+    default:
+        return false;
+    }
+
+    end++;
+    return *end == '\0' || *end == '\n';
+}
+
+static uint64_t *bitmap_chunk(struct bitmap *b, uint64_t chunk, bool create)
+{
+    if (create && 2 * (b->n + 1) > b->size) {
+        struct bitmap old = *b;
+        b->size = old.size ? 2 * old.size : 1024;
+        b->n = 0;
+        b->keys = calloc(b->size, sizeof(uint64_t));
+        b->bits = calloc(b->size, sizeof(uint64_t *));
+        if (!b->keys || !b->bits) {
+            perror("error: allocating bitmap");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old.size; i++) {
+            if (!old.keys[i])
+                continue;
+            size_t j = old.keys[i] % b->size;
+            while (b->keys[j])
+                j = (j + 1) % b->size;
+            b->keys[j] = old.keys[i];
+            b->bits[j] = old.bits[i];
+            b->n++;
+        }
+        free(old.keys);
+        free(old.bits);
+    }
+    if (!b->size)
+        return NULL;
+
+    // Keys are stored plus one so that zero marks a free slot
+    size_t i = (chunk + 1) % b->size;
+    while (b->keys[i] && b->keys[i] != chunk + 1)
+        i = (i + 1) % b->size;
+    if (b->keys[i])
+        return b->bits[i];
+    if (!create)
+        return NULL;
+
+    b->keys[i] = chunk + 1;
+    b->bits[i] = calloc(CHUNK_WORDS, sizeof(uint64_t));
+    if (!b->bits[i]) {
+        perror("error: allocating bitmap");
+        exit(EXIT_FAILURE);
+    }
+    b->n++;
+    return b->bits[i];
+}
+
+enum bitmap_op {
+    BITMAP_COUNT,
+    BITMAP_CLEAR,
+    BITMAP_SET,
+};
+
+// Apply op to the pages [start, start + len) a word at a time. Returns the
+// number of pages that were set before.
+static uint64_t bitmap_range(struct bitmap *b, uint64_t start, uint64_t len, enum bitmap_op op)
+{
+    uint64_t count = 0;
+
+    while (len) {
+        uint64_t off = start % CHUNK_PAGES;
+        uint64_t n = CHUNK_PAGES - off < len ? CHUNK_PAGES - off : len;
+        uint64_t *bits = bitmap_chunk(b, start / CHUNK_PAGES, op == BITMAP_SET);
+
+        start += n;
+        len -= n;
+        if (!bits)
+            continue;
+
+        while (n) {
+            uint64_t bit = off % 64;
+            uint64_t k = 64 - bit < n ? 64 - bit : n;
+            uint64_t mask = (k == 64 ? ~0ULL : (1ULL << k) - 1) << bit;
+            uint64_t *w = &bits[off / 64];
+
+            count += __builtin_popcountll(*w & mask);
+            if (op == BITMAP_CLEAR)
+                *w &= ~mask;
+            else if (op == BITMAP_SET)
+                *w |= mask;
+            off += k;
+            n -= k;
+        }
+    }
+    return count;
+}
+
+static void sim_unmap(struct sim *s, uint64_t start, uint64_t len)
+{
+    if (s->kind == POLICY_IDEAL) {
+        s->local -= len;
+        return;
+    }
+    uint64_t local = bitmap_range(&s->local_pages, start, len, BITMAP_CLEAR);
+    s->local -= local;
+    s->remote -= len - local;
+}
+
+// New pages go local while there is room, as the kernel falls back to the
+// far nodes when the local ones are full. Interleaving sends N of every N+M
+// pages local.
+static void sim_map(struct sim *s, uint64_t start, uint64_t len)
+{
+    if (s->kind == POLICY_IDEAL) {
+        s->local += len;
+        return;
+    }
+    if (s->kind == POLICY_FIRST) {
+        uint64_t room = s->capacity - s->local;
+        uint64_t n = len < room ? len : room;
+        if (n)
+            bitmap_range(&s->local_pages, start, n, BITMAP_SET);
+        s->local += n;
+        s->remote += len - n;
+        return;
+    }
+
+    const int cycle = s->weight[0] + s->weight[1];
+    for (uint64_t p = start; p < start + len; p++) {
+        if (s->pos < s->weight[0] && s->local < s->capacity) {
+            bitmap_range(&s->local_pages, p, 1, BITMAP_SET);
+            s->local++;
+        } else {
+            s->remote++;
+        }
+        s->pos = (s->pos + 1) % cycle;
+    }
+}
+
+static void sim_reference(struct sim *s, uint64_t start, uint64_t len)
+{
+    s->ref += len;
+    if (s->kind != POLICY_IDEAL)
+        s->hits += bitmap_range(&s->local_pages, start, len, BITMAP_COUNT);
+}
+
+// The ideal tiering oracle keeps every page referenced in an epoch local,
+// as far as the capacity allows, with migrations for free. It bounds what
+// any tiering policy can reach and needs no per-page state: s->local holds
+// all mapped pages, and local memory is always full.
+static void sim_placed(const struct sim *s, uint64_t *local, uint64_t *remote)
+{
+    *local = s->local;
+    *remote = s->remote;
+    if (s->kind == POLICY_IDEAL) {
+        *local = s->local < s->capacity ? s->local : s->capacity;
+        *remote = s->local - *local;
+    }
+}
+
+static void sim_epoch_end(struct sim *s)
+{
+    uint64_t local, remote;
+
+    sim_placed(s, &local, &remote);
+    if (s->kind == POLICY_IDEAL)
+        s->hits = s->ref < s->capacity ? s->ref : s->capacity;
+    s->total_ref += s->ref;
+    s->total_hits += s->hits;
+    if (local > s->max_local)
+        s->max_local = local;
+    if (remote > s->max_remote)
+        s->max_remote = remote;
+}
+
+static uint64_t decode_varint(const uint8_t **p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    fprintf(stderr, "error: corrupt epoch in trace\n");
+    exit(EXIT_FAILURE);
+}
+
+static void decode_runs(const uint8_t **p, const uint8_t *end, uint32_t n, struct runs *r)
+{
+    if (n > r->max) {
+        r->max = n;
+        r->start = realloc(r->start, n * sizeof(uint64_t));
+        r->len = realloc(r->len, n * sizeof(uint64_t));
+        if (!r->start || !r->len) {
+            perror("error: allocating runs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t last = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        r->start[i] = last + decode_varint(p, end);
+        r->len[i] = decode_varint(p, end) + 1;
+        last = r->start[i] + r->len[i];
+    }
+    r->n = n;
+}
+
+// Next complete epoch after p, NULL at the end of the trace
+static const struct emutrace_epoch *trace_next(const struct trace *t, const uint8_t *p)
+{
+    const struct emutrace_epoch *ep = (const struct emutrace_epoch *)p;
+    if (t->end - p < (ptrdiff_t)sizeof(*ep) || t->end - p - sizeof(*ep) < ep->size)
+        return NULL;
+    return ep;
+}
+
+static void trace_open(struct trace *t, const char *name)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto fail;
+
+    if (st.st_size < (off_t)sizeof(struct emutrace_header)) {
+        fprintf(stderr, "error: '%s' is not a trace\n", name);
+        exit(EXIT_FAILURE);
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto fail;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    t->name = name;
+    t->header = map;
+    t->end = (const uint8_t *)map + st.st_size;
+    if (memcmp(t->header->magic, EMUTRACE_MAGIC, sizeof(t->header->magic)) != 0) {
+        fprintf(stderr, "error: '%s' is not a trace\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (t->header->version != EMUTRACE_VERSION) {
+        fprintf(stderr, "error: unsupported trace version in '%s'\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return;
+
+fail:
+    fprintf(stderr, "error: opening file '%s': ", name);
+    perror(NULL);
+    exit(EXIT_FAILURE);
+}
+
+// Policy names as in emu: first (first-touch, the default with -l),
+// weighted:N:M (-X), interleave (weighted:1:1) and ideal
+static bool parse_policy(char *s, struct sim *sim)
+{
+    sim->name = s;
+    sim->weight[0] = sim->weight[1] = 1;
+
+    if (strcmp(s, "first") == 0) {
+        sim->kind = POLICY_FIRST;
+        return true;
+    }
+    if (strcmp(s, "ideal") == 0) {
+        sim->kind = POLICY_IDEAL;
+        return true;
+    }
+    if (strcmp(s, "interleave") == 0) {
+        sim->kind = POLICY_WEIGHTED;
+        return true;
+    }
+    int n = 0;
+    if (sscanf(s, "weighted:%d:%d%n", &sim->weight[0], &sim->weight[1], &n) == 2 &&
+            !s[n] && sim->weight[0] >= 0 && sim->weight[1] >= 0 &&
+            sim->weight[0] + sim->weight[1] > 0) {
+        sim->kind = POLICY_WEIGHTED;
+        return true;
+    }
+    return false;
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-l size,...] [-p policy,...] [-q] trace\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    char default_sizes[] = "25%,50%,75%";
+    char default_policies[] = "first,interleave,ideal";
+    char *sizes = default_sizes, *policies = default_policies;
+    bool quiet = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:p:q")) != -1) {
+        switch (opt) {
+        case 'l':
+            sizes = optarg;
+            break;
+        case 'p':
+            policies = optarg;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct trace t;
+    trace_open(&t, argv[optind]);
+    const double page = t.header->page_size;
+    const uint8_t *first = (const uint8_t *)(t.header + 1);
+
+    // Sizes may be given relative to the largest footprint of the trace
+    uint64_t mapped = 0, peak = 0;
+    long epochs = 0;
+    struct runs runs[EMUTRACE_LISTS] = {};
+    const struct emutrace_epoch *ep;
+    for (const uint8_t *p = first; (ep = trace_next(&t, p)); p += sizeof(*ep) + ep->size) {
+        const uint8_t *q = (const uint8_t *)(ep + 1), *end = q + ep->size;
+        for (int l = 0; l < EMUTRACE_REFERENCED; l++) {
+            decode_runs(&q, end, ep->runs[l], &runs[l]);
+            for (size_t i = 0; i < runs[l].n; i++) {
+                if (l == EMUTRACE_UNMAPPED)
+                    mapped -= runs[l].len[i];
+                else
+                    mapped += runs[l].len[i];
+            }
+        }
+        if (mapped > peak)
+            peak = mapped;
+        epochs++;
+    }
+
+    printf("whatif: epochs %ld peakGB %.2f source %s\n", epochs, peak * page / GB,
+            t.header->source == EMUTRACE_IDLE ? "idle" : "dirty");
+
+    int nsizes = 1, npolicies = 1;
+    for (char *c = sizes; *c; c++)
+        nsizes += *c == ',';
+    for (char *c = policies; *c; c++)
+        npolicies += *c == ',';
+
+    int nsims = 0;
+    struct sim *sims = calloc(nsizes * npolicies, sizeof(struct sim));
+    uint64_t *capacity = calloc(nsizes, sizeof(uint64_t));
+    if (!sims || !capacity) {
+        perror("error: allocating policies");
+        exit(EXIT_FAILURE);
+    }
+
+    nsizes = 0;
+    for (char *s = strtok(sizes, ","); s; s = strtok(NULL, ",")) {
+        char *end = NULL;
+        long long size;
+        if (s[strlen(s) - 1] == '%') {
+            double percent = strtod(s, &end);
+            if (end == s || *end != '%' || percent < 0) {
+                fprintf(stderr, "error: invalid size in -l option\n");
+                exit(EXIT_FAILURE);
+            }
+            capacity[nsizes++] = peak * percent / 100 + 0.5;
+        } else if (parse_size(s, &size) && size >= 0) {
+            capacity[nsizes++] = size / t.header->page_size;
+        } else {
+            fprintf(stderr, "error: invalid size in -l option\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (char *s = strtok(policies, ","); s; s = strtok(NULL, ",")) {
+        for (int i = 0; i < nsizes; i++) {
+            struct sim *sim = &sims[nsims++];
+            if (!parse_policy(s, sim)) {
+                fprintf(stderr, "error: invalid policy '%s' in -p option\n", s);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            sim->capacity = capacity[i];
+        }
+    }
+
+    // Each epoch is decoded once and replayed on every configuration.
+    // Unmapped pages go first, so the capacity they free is reused by the
+    // pages mapped in the same epoch.
+    for (const uint8_t *p = first; (ep = trace_next(&t, p)); p += sizeof(*ep) + ep->size) {
+        const uint8_t *q = (const uint8_t *)(ep + 1), *end = q + ep->size;
+        for (int l = 0; l < EMUTRACE_LISTS; l++)
+            decode_runs(&q, end, ep->runs[l], &runs[l]);
+
+        for (int j = 0; j < nsims; j++) {
+            struct sim *s = &sims[j];
+            s->ref = s->hits = 0;
+
+            const struct runs *r = &runs[EMUTRACE_UNMAPPED];
+            for (size_t i = 0; i < r->n; i++)
+                sim_unmap(s, r->start[i], r->len[i]);
+            r = &runs[EMUTRACE_MAPPED];
+            for (size_t i = 0; i < r->n; i++)
+                sim_map(s, r->start[i], r->len[i]);
+            r = &runs[EMUTRACE_REFERENCED];
+            for (size_t i = 0; i < r->n; i++)
+                sim_reference(s, r->start[i], r->len[i]);
+            sim_epoch_end(s);
+
+            if (quiet)
+                continue;
+            uint64_t local, remote;
+            sim_placed(s, &local, &remote);
+            printf("whatif: policy %s capacityGB %.2f hit%% %.2f refGB %.2f localGB %.2f remoteGB %.2f time %.2f\n",
+                    s->name, s->capacity * page / GB,
+                    s->ref ? 100.0 * s->hits / s->ref : 0.0, s->ref * page / GB,
+                    local * page / GB, remote * page / GB, ep->time);
+        }
+    }
+
+    for (int j = 0; j < nsims; j++) {
+        struct sim *s = &sims[j];
+        printf("whatif: total policy %s capacityGB %.2f hit%% %.2f refGB %.2f maxlocalGB %.2f maxremoteGB %.2f\n",
+                s->name, s->capacity * page / GB,
+                s->total_ref ? 100.0 * s->total_hits / s->total_ref : 0.0,
+                s->total_ref * page / GB, s->max_local * page / GB, s->max_remote * page / GB);
+    }
+
+    return EXIT_SUCCESS;
+}